@@ -1,4 +1,6 @@
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
@@ -7,101 +9,215 @@
 #include <unordered_map>
 #include <vector>
 
+#include "interpreter.hpp"
 #include "libbytecode.hpp"
+#include "profile.hpp"
+#include "server.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+
+// Time limits are checked every time this much fuel is used up.
+#define TIME_SLICE_FUEL (1 << 24)
+
+struct StandardIO {
+    bool read(uint8_t& c)
+    {
+        c = std::getchar();
+        return true;
+    }
+
+    void write(uint8_t c)
+    {
+        std::putchar(c);
+    }
+};
+
+struct RunOptions {
+    // Fuel for the whole execution, negative for unlimited
+    int64_t fuel = -1;
+    // Time limit in seconds, negative for unlimited
+    double timeLimit = -1;
+    // Where to periodically save snapshots to, empty for never
+    std::string checkpoint;
+    double checkpointInterval = 60;
+    // Records the tape accesses if set
+    TapeProfile* profile = nullptr;
+};
+
+/**
+ * @brief Runs the machine metered until it either ends, has no fuel left or
+ * exceeds the time limit. Since we don't want to read the clock all the time,
+ * the time limit and whether we need to take a checkpoint are only checked
+ * every TIME_SLICE_FUEL.
+ *
+ * @param machine
+ * @param opcodes
+ * @param options
+ * @return true if the program ended, otherwise false.
+ */
+bool runMetered(Machine& machine, std::vector<uint8_t>& opcodes, RunOptions& options)
+{
+    StandardIO io;
+    int64_t fuel = options.fuel;
+    bool sliced = options.timeLimit >= 0 || !options.checkpoint.empty();
+    auto start = std::chrono::steady_clock::now();
+    auto lastCheckpoint = start;
+
+    // The machine stopped at the start of a loop, so a stopped execution can
+    // be continued from its last snapshot with more fuel or time.
+    auto stop = [&](const char* message) {
+        std::cerr << "ERROR: " << message << std::endl;
+        if (!options.checkpoint.empty())
+            saveSnapshotInForeground(options.checkpoint, machine, opcodes);
+        return false;
+    };
+
+    for (;;) {
+        // Without a time limit we can hand out all the fuel at once.
+        int64_t slice = fuel;
+        if (sliced && (fuel < 0 || fuel > TIME_SLICE_FUEL))
+            slice = TIME_SLICE_FUEL;
+
+        machine.fuel = slice;
+        ExitReason reason = options.profile != nullptr
+            ? interpret<true, true>(machine, opcodes, io, options.profile)
+            : interpret<true>(machine, opcodes, io);
+        if (reason == EXIT_DONE)
+            return true;
+
+        // The machine overdraws a little as it only checks at loops.
+        if (fuel >= 0) {
+            fuel -= slice - machine.fuel;
+            if (fuel < 0)
+                return stop("Out of fuel");
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - start;
+        if (options.timeLimit >= 0 && elapsed.count() > options.timeLimit)
+            return stop("Time limit exceeded");
+
+        // The machine stopped at the start of a loop, which is a safe point
+        // for all engines.
+        std::chrono::duration<double> sinceCheckpoint = now - lastCheckpoint;
+        if (!options.checkpoint.empty() && sinceCheckpoint.count() > options.checkpointInterval) {
+            saveSnapshotInBackground(options.checkpoint, machine, opcodes);
+            lastCheckpoint = now;
+        }
+    }
+}
 
 int main(int argc, char const* argv[])
 {
     // Read input file
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " INPUT" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [--stats] [--fuel N] [--time-limit SECONDS] [--checkpoint FILE] [--checkpoint-interval SECONDS] [--restore FILE] [--profile PREFIX] [--trace] [--serve PORT] INPUT" << std::endl;
         exit(1);
     }
 
+    // Parse the options, any unknown argument just dumps the bytecode.
+    bool dump = false;
+    bool printStatistics = false;
+    bool trace = false;
+    int port = -1;
+    RunOptions options;
+    std::string restore;
+    std::string profilePrefix;
+    for (int i = 1; i < argc - 1; i++) {
+        if (std::strcmp(argv[i], "--stats") == 0) {
+            printStatistics = true;
+        } else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc - 1) {
+            char* end;
+            long value = std::strtol(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || value < 0 || value > UINT16_MAX) {
+                std::cerr << "ERROR: Invalid port " << argv[i] << std::endl;
+                exit(1);
+            }
+            port = value;
+        } else if (std::strcmp(argv[i], "--fuel") == 0 && i + 1 < argc - 1) {
+            options.fuel = std::atoll(argv[++i]);
+        } else if (std::strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc - 1) {
+            options.timeLimit = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc - 1) {
+            options.checkpoint = argv[++i];
+        } else if (std::strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc - 1) {
+            options.checkpointInterval = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--restore") == 0 && i + 1 < argc - 1) {
+            restore = argv[++i];
+        } else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc - 1) {
+            profilePrefix = argv[++i];
+        } else if (std::strcmp(argv[i], "--trace") == 0) {
+            trace = true;
+        } else {
+            dump = true;
+        }
+    }
+
     std::ifstream in(argv[argc - 1]);
     std::string source(static_cast<std::stringstream const&>(std::stringstream() << in.rdbuf()).str());
 
-    // Setup the datastructure
-    uint8_t array[30000];
-    std::memset(array, 0, 30000);
-    uint8_t* dataPointer = array;
-    uint64_t instructionPointer = 0;
-
     // Compile the code to bytecode
-    auto opcodes = compileByteCode(source);
-    if (argc > 2) {
+    CompileStats stats;
+    auto opcodes = compileByteCode(source, printStatistics ? &stats : nullptr);
+    if (printStatistics) {
+        printStats(stats, opcodes);
+        exit(0);
+    }
+
+    if (dump) {
         printByteCode(opcodes);
         std::cout << opcodes.size() << std::endl;
         exit(0);
     }
 
-    // Interpret the bytecode
-    for (; instructionPointer < opcodes.size(); instructionPointer++) {
-        // std::cout << instructionPointer << " -> " << dataPointer << std::endl;
-        switch (opcodes.at(instructionPointer)) {
-        case OP_MOVE: {
-            int8_t argument = readByteArgument(opcodes, instructionPointer);
-            dataPointer += argument;
-            break;
-        }
-
-        case OP_INC: {
-            int8_t offset = readByteArgument(opcodes, instructionPointer);
-            int8_t increment = readByteArgument(opcodes, instructionPointer);
-            *(dataPointer + offset) += increment;
-            break;
-        }
-
-        case OP_OPEN: {
-            // If the byte at the datapointer is not zero we don't do anything
-            if (*dataPointer != 0) {
-                // jump over argument
-                instructionPointer += 8;
-                break;
-            }
-
-            // Jump to the target destination
-            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
-            instructionPointer = argument;
-            break;
-        }
-
-        case OP_CLOSE: {
-            // If the byte at the datapointer is zero we don't do anything
-            if (*dataPointer == 0) {
-                // jump over argument
-                instructionPointer += 8;
-                break;
-            }
-
-            // Jump to the target destination
-            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
-            instructionPointer = argument;
-            break;
-        }
+    // Serve the program to many clients at once
+    if (port >= 0) {
+        return serve(opcodes, port, options.fuel);
+    }
 
-        case OP_CLEAR: {
-            *dataPointer = 0;
-            break;
-        }
+    // Continue where the snapshot stopped
+    Machine machine;
+    if (!restore.empty()) {
+        if (!loadSnapshot(restore, machine, opcodes))
+            exit(1);
+        restoreStandardStreams(machine);
+    }
 
-        case OP_MUL: {
-            int8_t offset = readByteArgument(opcodes, instructionPointer);
-            int8_t factor = readByteArgument(opcodes, instructionPointer);
-            *(dataPointer + offset) += *dataPointer * factor;
-            break;
-        }
+    // Interpret the bytecode, but only pay for metering and profiling if we
+    // have to.
+    TapeProfile profile(machine.tape.size(), machine.dataPointer);
+    if (!profilePrefix.empty())
+        options.profile = &profile;
 
-        case OP_WRITE:
-            std::putchar(*dataPointer);
-            break;
+    bool metered = options.fuel >= 0 || options.timeLimit >= 0 || !options.checkpoint.empty();
+    if (trace && (metered || options.profile != nullptr)) {
+        std::cerr << "ERROR: --trace can't be combined with metering or profiling" << std::endl;
+        exit(1);
+    }
 
-        case OP_READ:
-            *dataPointer = std::getchar();
-            break;
+    bool ended = true;
+    if (metered) {
+        ended = runMetered(machine, opcodes, options);
+    } else if (options.profile != nullptr) {
+        StandardIO io;
+        interpret<false, true>(machine, opcodes, io, options.profile);
+    } else if (trace) {
+        StandardIO io;
+        Tracer tracer(opcodes);
+        interpret<false, false, true>(machine, opcodes, io, nullptr, &tracer);
+    } else {
+        StandardIO io;
+        interpret(machine, opcodes, io);
+    }
 
-        default:
-            std::cerr << "ERROR: Unknown opcode!" << std::endl;
+    // Programs that got stopped still have a profile up to that point.
+    if (options.profile != nullptr) {
+        std::fflush(stdout);
+        printProfileSummary(profile);
+        if (!writeProfile(profilePrefix, profile))
             exit(1);
-        }
     }
+
+    if (!ended)
+        exit(2);
 }
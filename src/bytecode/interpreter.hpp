@@ -0,0 +1,250 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "libbytecode.hpp"
+#include "machine.hpp"
+#include "profile.hpp"
+#include "trace.hpp"
+
+enum ExitReason {
+    EXIT_DONE, //   the program ran to the end
+    EXIT_INPUT, //  the program is paused at a read because there is no input
+    EXIT_FUEL, //   the program is paused at a loop because it ran out of fuel
+};
+
+/**
+ * @brief Interprets the bytecode on the machine until the program either ends
+ * or reads while there is no input available. In the latter case the machine
+ * stops at the read instruction and interpret can be called again once there
+ * is more input.
+ *
+ * The IO must provide `bool read(uint8_t& c)`, which returns false if there is
+ * no input yet, and `void write(uint8_t c)`.
+ *
+ * Metered executions charge the fuel of the machine and stop at the next loop
+ * iteration once it is used up. To keep the overhead low, we only charge and
+ * check at the back-edges of loops, as all code without loops ends anyway.
+ * Every iteration costs the size of the loop body in bytes and multiply loops
+ * cost as much as the loops they replace.
+ *
+ * Profiled executions record every tape access and move in the profile.
+ *
+ * Traced executions record the paths hot loops take and run them as traces
+ * from then on, see Tracer.
+ *
+ * @param machine
+ * @param opcodes
+ * @param io
+ * @param profile only used by profiled executions.
+ * @param tracer only used by traced executions.
+ * @return the reason why the execution stopped.
+ */
+template <bool Metered = false, bool Profiled = false, bool Traced = false, typename IO>
+ExitReason interpret(Machine& machine, std::vector<uint8_t>& opcodes, IO& io, TapeProfile* profile = nullptr, Tracer* tracer = nullptr)
+{
+    uint8_t* dataPointer = machine.tape.data() + machine.dataPointer;
+    uint64_t instructionPointer = machine.instructionPointer;
+    std::vector<uint8_t>& counters = machine.counters;
+    int64_t fuel = machine.fuel;
+
+    // Position of the cell at the offset from the data pointer
+    [[maybe_unused]] auto cell = [&](int8_t offset) { return dataPointer + offset - machine.tape.data(); };
+
+    for (; instructionPointer < opcodes.size(); instructionPointer++) {
+        // std::cout << instructionPointer << " -> " << dataPointer << std::endl;
+        if constexpr (Profiled)
+            profile->step();
+        if constexpr (Traced) {
+            if (tracer->recording)
+                tracer->record(instructionPointer, dataPointer, counters);
+        }
+
+        switch (opcodes.at(instructionPointer)) {
+        case OP_MOVE: {
+            int8_t argument = readByteArgument(opcodes, instructionPointer);
+            dataPointer += argument;
+            if constexpr (Profiled)
+                profile->move(argument, cell(0));
+            break;
+        }
+
+        case OP_INC: {
+            int8_t offset = readByteArgument(opcodes, instructionPointer);
+            int8_t increment = readByteArgument(opcodes, instructionPointer);
+            *(dataPointer + offset) += increment;
+            if constexpr (Profiled) {
+                profile->read(cell(offset));
+                profile->write(cell(offset));
+            }
+            break;
+        }
+
+        case OP_OPEN: {
+            if constexpr (Profiled)
+                profile->read(cell(0));
+
+            // If the byte at the datapointer is not zero we don't do anything
+            if (*dataPointer != 0) {
+                // jump over argument
+                instructionPointer += 8;
+                if constexpr (Traced) {
+                    if (Trace* trace = tracer->atLoopEntry(instructionPointer + 1))
+                        instructionPointer = runTrace(*trace, dataPointer, machine, io) - 1;
+                }
+                break;
+            }
+
+            // Jump to the target destination
+            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
+            instructionPointer = argument;
+            break;
+        }
+
+        case OP_CLOSE: {
+            if constexpr (Profiled)
+                profile->read(cell(0));
+
+            // If the byte at the datapointer is zero we don't do anything
+            if (*dataPointer == 0) {
+                // jump over argument
+                instructionPointer += 8;
+                break;
+            }
+
+            // Jump to the target destination
+            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
+            if constexpr (Metered) {
+                fuel -= instructionPointer - argument;
+                if (fuel < 0) {
+                    machine.dataPointer = dataPointer - machine.tape.data();
+                    machine.instructionPointer = argument + 1;
+                    machine.fuel = fuel;
+                    return EXIT_FUEL;
+                }
+            }
+            instructionPointer = argument;
+            if constexpr (Traced) {
+                if (Trace* trace = tracer->atBackEdge(argument + 1))
+                    instructionPointer = runTrace(*trace, dataPointer, machine, io) - 1;
+            }
+            break;
+        }
+
+        case OP_COUNT_OPEN: {
+            if constexpr (Profiled)
+                profile->read(cell(0));
+
+            // If the byte at the datapointer is zero we skip the loop,
+            // otherwise it is the number of iterations.
+            if (*dataPointer != 0) {
+                counters.push_back(*dataPointer);
+                instructionPointer += 8;
+                if constexpr (Traced) {
+                    if (Trace* trace = tracer->atLoopEntry(instructionPointer + 1))
+                        instructionPointer = runTrace(*trace, dataPointer, machine, io) - 1;
+                }
+                break;
+            }
+
+            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
+            instructionPointer = argument;
+            break;
+        }
+
+        case OP_COUNT_CLOSE: {
+            // Once the counter reaches zero the loop is done, and so is the
+            // cell at the datapointer.
+            if (--counters.back() == 0) {
+                counters.pop_back();
+                instructionPointer += 8;
+                break;
+            }
+
+            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
+            if constexpr (Metered) {
+                fuel -= instructionPointer - argument;
+                if (fuel < 0) {
+                    machine.dataPointer = dataPointer - machine.tape.data();
+                    machine.instructionPointer = argument + 1;
+                    machine.fuel = fuel;
+                    return EXIT_FUEL;
+                }
+            }
+            instructionPointer = argument;
+            if constexpr (Traced) {
+                if (Trace* trace = tracer->atBackEdge(argument + 1))
+                    instructionPointer = runTrace(*trace, dataPointer, machine, io) - 1;
+            }
+            break;
+        }
+
+        case OP_CLEAR: {
+            if constexpr (Metered) {
+                // The loop would have run as often as the value of the cell,
+                // decrementing it with a three byte increment every time.
+                fuel -= *dataPointer * 3;
+            }
+            *dataPointer = 0;
+            if constexpr (Profiled)
+                profile->write(cell(0));
+            break;
+        }
+
+        case OP_MUL: {
+            int8_t offset = readByteArgument(opcodes, instructionPointer);
+            int8_t factor = readByteArgument(opcodes, instructionPointer);
+            *(dataPointer + offset) += *dataPointer * factor;
+            if constexpr (Metered) {
+                // The loop would have run as often as the value of the cell
+                // and incremented the target every time. This leaves out the
+                // moves to the target, so it's a bit less than the loop cost.
+                fuel -= *dataPointer * 3;
+            }
+            if constexpr (Profiled) {
+                // The loop wouldn't have run at all if the cell is zero.
+                profile->read(cell(0));
+                if (*dataPointer != 0) {
+                    profile->read(cell(offset));
+                    profile->write(cell(offset));
+                }
+            }
+            break;
+        }
+
+        case OP_WRITE:
+            io.write(*dataPointer);
+            if constexpr (Metered)
+                machine.outputOffset++;
+            if constexpr (Profiled)
+                profile->read(cell(0));
+            break;
+
+        case OP_READ:
+            // Pause at this instruction so that we retry the read once we
+            // get resumed.
+            if (!io.read(*dataPointer)) {
+                machine.dataPointer = dataPointer - machine.tape.data();
+                machine.instructionPointer = instructionPointer;
+                machine.fuel = fuel;
+                return EXIT_INPUT;
+            }
+            if constexpr (Metered)
+                machine.inputOffset++;
+            if constexpr (Profiled)
+                profile->write(cell(0));
+            break;
+
+        default:
+            std::cerr << "ERROR: Unknown opcode!" << std::endl;
+            exit(1);
+        }
+    }
+
+    machine.dataPointer = dataPointer - machine.tape.data();
+    machine.instructionPointer = instructionPointer;
+    machine.fuel = fuel;
+    return EXIT_DONE;
+}
@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <chrono>
 #include <deque>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <unordered_map>
 
 #include "libbytecode.hpp"
 
@@ -131,6 +135,22 @@ void printByteCode(std::vector<uint8_t> opcodes)
             break;
         }
 
+        case OP_COUNT_OPEN: {
+            uint64_t pos = instructionPointer;
+            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
+            std::cout << std::setfill('0') << std::setw(3) << pos << ": ";
+            std::cout << "OP_COUNT_OPEN " << argument << std::endl;
+            break;
+        }
+
+        case OP_COUNT_CLOSE: {
+            uint64_t pos = instructionPointer;
+            uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
+            std::cout << std::setfill('0') << std::setw(3) << pos << ": ";
+            std::cout << "OP_COUNT_CLOSE " << argument << std::endl;
+            break;
+        }
+
         default:
             std::cerr << "ERROR: Unknown opcode!" << std::endl;
             std::cerr << "InstructionPointer: " << instructionPointer << std::endl;
@@ -140,6 +160,97 @@ void printByteCode(std::vector<uint8_t> opcodes)
     }
 }
 
+/**
+ * @brief Prints the statistics of the compilation together with a histogram of
+ * the opcodes as JSON.
+ *
+ * @param stats
+ * @param opcodes
+ */
+void printStats(CompileStats& stats, std::vector<uint8_t>& opcodes)
+{
+    // Count the opcodes, the order is the one of the OpCode enum
+    const char* names[] = { "OP_MOVE", "OP_INC", "OP_WRITE", "OP_READ", "OP_OPEN", "OP_CLOSE", "OP_CLEAR", "OP_MUL", "OP_COUNT_OPEN", "OP_COUNT_CLOSE" };
+    uint64_t histogram[std::size(names)] = { 0 };
+    uint64_t instructions = 0;
+    for (uint64_t instructionPointer = 0; instructionPointer < opcodes.size(); instructionPointer++) {
+        uint8_t opcode = opcodes.at(instructionPointer);
+        switch (opcode) {
+        case OP_MOVE:
+            ignoreByteArgument(instructionPointer);
+            break;
+        case OP_INC:
+        case OP_MUL:
+            ignoreByteArgument(instructionPointer);
+            ignoreByteArgument(instructionPointer);
+            break;
+        case OP_OPEN:
+        case OP_CLOSE:
+        case OP_COUNT_OPEN:
+        case OP_COUNT_CLOSE:
+            ignoreEightByteArgument(instructionPointer);
+            break;
+        default:
+            break;
+        }
+
+        if (opcode < std::size(names))
+            histogram[opcode]++;
+        instructions++;
+    }
+
+    std::cout << "{" << std::endl;
+    std::cout << "  \"source_instructions\": " << stats.sourceInstructions << "," << std::endl;
+    std::cout << "  \"bytecode_bytes\": " << opcodes.size() << "," << std::endl;
+    std::cout << "  \"bytecode_instructions\": " << instructions << "," << std::endl;
+    std::cout << "  \"bytes_per_source_instruction\": "
+              << (stats.sourceInstructions ? (double)opcodes.size() / stats.sourceInstructions : 0) << "," << std::endl;
+    std::cout << "  \"source_instructions_per_instruction\": "
+              << (instructions ? (double)stats.sourceInstructions / instructions : 0) << "," << std::endl;
+
+    std::cout << "  \"timing_ns\": {" << std::endl;
+    std::cout << "    \"strip_comments\": " << stats.stripNanoseconds << "," << std::endl;
+    std::cout << "    \"pattern_matching\": " << stats.matchNanoseconds << "," << std::endl;
+    std::cout << "    \"emission\": " << stats.emitNanoseconds << std::endl;
+    std::cout << "  }," << std::endl;
+
+    std::cout << "  \"patterns\": {" << std::endl;
+    std::cout << "    \"clear_loop\": " << stats.clearLoops << "," << std::endl;
+    std::cout << "    \"copy_loop\": " << stats.copyLoops << "," << std::endl;
+    std::cout << "    \"multiply_loop\": " << stats.multiplyLoops << "," << std::endl;
+    std::cout << "    \"counted_loop\": " << stats.countedLoops << "," << std::endl;
+    std::cout << "    \"deferred_moves\": " << stats.deferredMoves << std::endl;
+    std::cout << "  }," << std::endl;
+
+    std::cout << "  \"rejections\": {";
+    for (auto pattern = stats.rejections.begin(); pattern != stats.rejections.end(); pattern++) {
+        std::cout << (pattern == stats.rejections.begin() ? "" : ",") << std::endl;
+        std::cout << "    \"" << pattern->first << "\": {";
+        for (auto reason = pattern->second.begin(); reason != pattern->second.end(); reason++) {
+            std::cout << (reason == pattern->second.begin() ? "" : ",") << std::endl;
+            std::cout << "      \"" << reason->first << "\": " << reason->second;
+        }
+        std::cout << std::endl
+                  << "    }";
+    }
+    std::cout << std::endl
+              << "  }," << std::endl;
+
+    std::cout << "  \"opcodes\": {" << std::endl;
+    for (size_t i = 0; i < std::size(names); i++) {
+        std::cout << "    \"" << names[i] << "\": " << histogram[i] << (i + 1 < std::size(names) ? "," : "") << std::endl;
+    }
+    std::cout << "  }" << std::endl;
+    std::cout << "}" << std::endl;
+}
+
+// Statistics are only collected if somebody asked for them.
+static void countRejection(CompileStats* stats, const char* pattern, const char* reason)
+{
+    if (stats != nullptr)
+        stats->rejections[pattern][reason]++;
+}
+
 /**
  * @brief Tries to generate increment and decrement opcodes with an offset and
  * defers the actual datapointer movements until they are abosoluty necessary,
@@ -147,10 +258,11 @@ void printByteCode(std::vector<uint8_t> opcodes)
  *
  * @param opcodes
  * @param instructionPointer
+ * @param stats
  * @return true
  * @return false
  */
-bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer, std::vector<uint8_t>& opcodes)
+bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer, std::vector<uint8_t>& opcodes, CompileStats* stats)
 {
     // NOTE: we use a singed 16 bit int here because we want to store increments
     // and decrements in the same datastructure.
@@ -162,7 +274,11 @@ bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer,
         char ins = source.at(currInstructionPointer);
         switch (ins) {
         case '>': {
+            // On overflows we stop before the current instruction, just like
+            // at the end of the section.
             if (currOffset == INT8_MAX) {
+                countRejection(stats, "deferred_moves", "offset_overflow");
+                currInstructionPointer--;
                 keepLooping = false;
                 break;
             }
@@ -172,6 +288,8 @@ bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer,
         }
         case '<': {
             if (currOffset == INT8_MIN) {
+                countRejection(stats, "deferred_moves", "offset_overflow");
+                currInstructionPointer--;
                 keepLooping = false;
                 break;
             }
@@ -185,6 +303,8 @@ bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer,
             }
 
             if (offsetIncrements[currOffset] == INT8_MAX) {
+                countRejection(stats, "deferred_moves", "increment_overflow");
+                currInstructionPointer--;
                 keepLooping = false;
                 break;
             }
@@ -197,7 +317,9 @@ bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer,
                 offsetIncrements[currOffset] = 0;
             }
 
-            if (offsetIncrements[currOffset] == INT8_MAX) {
+            if (offsetIncrements[currOffset] == INT8_MIN) {
+                countRejection(stats, "deferred_moves", "increment_overflow");
+                currInstructionPointer--;
                 keepLooping = false;
                 break;
             }
@@ -216,8 +338,10 @@ bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer,
     // This optimization only makes sense if we have more than 2 increments and
     // decrements.
     char lastChar = source.at(currInstructionPointer - 1);
-    if (!((offsetIncrements.size() > 1 && (lastChar == '>' || lastChar == '<')) || offsetIncrements.size() >= 2))
+    if (!((offsetIncrements.size() > 1 && (lastChar == '>' || lastChar == '<')) || offsetIncrements.size() >= 2)) {
+        countRejection(stats, "deferred_moves", "too_few_increments");
         return false;
+    }
 
     // Write all increments and decrements with the offset
     for (auto it : offsetIncrements) {
@@ -242,6 +366,8 @@ bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer,
     // Adjust the instruction pointer to the one before the current one cause
     // we couldn't yet generate code for the current instruction.
     instructionPointer = currInstructionPointer - 1;
+    if (stats != nullptr)
+        stats->deferredMoves++;
     return true;
 }
 
@@ -254,9 +380,10 @@ bool tryCompileDeferredMoves(std::string& source, uint64_t& instructionPointer,
  * @param source
  * @param instructionPointer
  * @param opcodes
+ * @param stats
  * @return true if it detected and compiled a clear loop, otherwise false.
  */
-bool tryCompileMultiplyLoop(std::string& source, uint64_t& instructionPointer, std::vector<uint8_t>& opcodes)
+bool tryCompileMultiplyLoop(std::string& source, uint64_t& instructionPointer, std::vector<uint8_t>& opcodes, CompileStats* stats)
 {
     // FIXME: Really thing if we could have an overflow here and how to fix it.
     std::map<int8_t, int8_t> offsetFactors;
@@ -267,15 +394,19 @@ bool tryCompileMultiplyLoop(std::string& source, uint64_t& instructionPointer, s
         char ins = source.at(currInstructionPointer);
         switch (ins) {
         case '>': {
-            if (currOffset == INT8_MAX)
+            if (currOffset == INT8_MAX) {
+                countRejection(stats, "multiply_loop", "offset_overflow");
                 return false;
+            }
 
             currOffset++;
             break;
         }
         case '<': {
-            if (currOffset == INT8_MIN)
+            if (currOffset == INT8_MIN) {
+                countRejection(stats, "multiply_loop", "offset_overflow");
                 return false;
+            }
 
             currOffset--;
             break;
@@ -285,8 +416,10 @@ bool tryCompileMultiplyLoop(std::string& source, uint64_t& instructionPointer, s
                 offsetFactors[currOffset] = 0;
             }
 
-            if (offsetFactors[currOffset] == INT8_MAX)
+            if (offsetFactors[currOffset] == INT8_MAX) {
+                countRejection(stats, "multiply_loop", "factor_overflow");
                 return false;
+            }
 
             offsetFactors[currOffset]++;
             break;
@@ -296,8 +429,10 @@ bool tryCompileMultiplyLoop(std::string& source, uint64_t& instructionPointer, s
                 offsetFactors[currOffset] = 0;
             }
 
-            if (offsetFactors[currOffset] == INT8_MIN)
+            if (offsetFactors[currOffset] == INT8_MIN) {
+                countRejection(stats, "multiply_loop", "factor_overflow");
                 return false;
+            }
 
             offsetFactors[currOffset]--;
             break;
@@ -305,18 +440,39 @@ bool tryCompileMultiplyLoop(std::string& source, uint64_t& instructionPointer, s
         default:
             // This is no longer a multiply loop so just exist and fallback to
             // the general implementation of loops
+            countRejection(stats, "multiply_loop", ins == '[' ? "nested_loop" : "io");
             return false;
         }
     }
 
     // Verify that it is a multiplication loop which must have:
     // 1) An equal amount of left-right movements
-    if (currOffset != 0)
+    if (currOffset != 0) {
+        countRejection(stats, "multiply_loop", "unbalanced");
         return false;
+    }
 
     // 2) The cell at the initial datapoint must be decremented by one.
-    if (offsetFactors.find(0) == offsetFactors.end() || offsetFactors[0] != -1)
+    if (offsetFactors.find(0) == offsetFactors.end() || offsetFactors[0] != -1) {
+        countRejection(stats, "multiply_loop", "no_unit_decrement");
         return false;
+    }
+
+    // Clear and copy loops are just special cases of multiply loops
+    bool copy = true;
+    for (const auto& it : offsetFactors) {
+        copy = copy && (it.first == 0 || it.second == 1);
+    }
+    if (offsetFactors.size() == 1) {
+        if (stats != nullptr)
+            stats->clearLoops++;
+    } else if (copy) {
+        if (stats != nullptr)
+            stats->copyLoops++;
+    } else {
+        if (stats != nullptr)
+            stats->multiplyLoops++;
+    }
 
     // Compile all multiply instructions
     for (const auto& it : offsetFactors) {
@@ -337,6 +493,148 @@ bool tryCompileMultiplyLoop(std::string& source, uint64_t& instructionPointer, s
     return true;
 }
 
+// Why a loop isn't a counted loop
+enum CountedLoopCheck : uint8_t {
+    COUNTED_LOOP, // it is one
+    COUNTER_CHANGED_IN_NESTED_LOOP,
+    COUNTER_READ,
+    UNBALANCED,
+    NO_UNIT_DECREMENT,
+    UNBALANCED_NESTED_LOOP,
+};
+
+static const char* countedLoopRejections[] = {
+    "",
+    "counter_changed_in_nested_loop",
+    "counter_read",
+    "unbalanced",
+    "no_unit_decrement",
+    "unbalanced_nested_loop",
+};
+
+/**
+ * @brief Checks for every loop if it is a counted loop. Counted loops
+ * decrement the cell at the initial datapointer exactly by one per iteration
+ * and don't touch it otherwise, so the number of iterations is the value of
+ * that cell when entering the loop.
+ * Unlike multiply loops they may contain I/O and nested loops, as long as all
+ * nested loops are balanced (otherwise we lose track of the offsets).
+ *
+ * All loops are checked in a single pass over the source, so that deeply
+ * nested programs don't take quadratic time. Offsets are counted from the
+ * start of the program and every open loop remembers the offset of its
+ * counter. A loop gets rejected for the first reason we find, just as if we
+ * had scanned its body on its own.
+ *
+ * @param source
+ * @return the CountedLoopCheck of every '[' in the source, by its position.
+ */
+std::vector<uint8_t> checkCountedLoops(std::string& source)
+{
+    struct OpenLoop {
+        uint64_t position;
+        int64_t counterOffset;
+        int64_t counterIncrement;
+        uint8_t rejection;
+        uint64_t rejectedAt;
+        // When the first unbalanced loop nested in this one ended. We only
+        // tell the direct parent and pass it on once the parent ends.
+        uint64_t unbalancedNestedAt;
+    };
+
+    std::vector<uint8_t> checks(source.size(), COUNTED_LOOP);
+    std::vector<OpenLoop> loops;
+    // The open loops by the offset of their counter, outer ones first. Loops
+    // leave it once they got rejected for touching their counter.
+    std::unordered_map<int64_t, std::vector<size_t>> counters;
+    int64_t offset = 0;
+
+    auto reject = [&](size_t loop, uint8_t reason, uint64_t position) {
+        if (loops.at(loop).rejection == COUNTED_LOOP) {
+            loops.at(loop).rejection = reason;
+            loops.at(loop).rejectedAt = position;
+        }
+    };
+
+    for (uint64_t position = 0; position < source.size(); position++) {
+        char ins = source.at(position);
+        switch (ins) {
+        case '>':
+            offset++;
+            break;
+        case '<':
+            offset--;
+            break;
+        case '+':
+        case '-': {
+            auto it = counters.find(offset);
+            if (it == counters.end())
+                break;
+
+            // Only the innermost loop may change its counter, for all outer
+            // loops it gets changed in a nested loop which may run a
+            // different number of times per iteration.
+            std::vector<size_t>& owners = it->second;
+            bool innermost = !owners.empty() && owners.back() == loops.size() - 1;
+            for (size_t i = 0; i + innermost < owners.size(); i++)
+                reject(owners.at(i), COUNTER_CHANGED_IN_NESTED_LOOP, position);
+            owners.erase(owners.begin(), owners.end() - innermost);
+
+            if (innermost)
+                loops.back().counterIncrement += ins == '+' ? 1 : -1;
+            break;
+        }
+        case ',': {
+            auto it = counters.find(offset);
+            if (it == counters.end())
+                break;
+
+            for (auto loop : it->second)
+                reject(loop, COUNTER_READ, position);
+            it->second.clear();
+            break;
+        }
+        case '[':
+            loops.push_back({ position, offset, 0, COUNTED_LOOP, UINT64_MAX, UINT64_MAX });
+            counters[offset].push_back(loops.size() - 1);
+            break;
+        case ']': {
+            // Unmatched brackets get reported by the compiler.
+            if (loops.empty())
+                break;
+
+            // This is the end of the loop, which must have an equal amount of
+            // left-right movements and decrement the counter by one.
+            size_t index = loops.size() - 1;
+            bool balanced = offset == loops.back().counterOffset;
+            if (!balanced)
+                reject(index, UNBALANCED, position);
+            else if ((uint8_t)loops.back().counterIncrement != UINT8_MAX)
+                reject(index, NO_UNIT_DECREMENT, position);
+
+            OpenLoop loop = loops.back();
+            loops.pop_back();
+            std::vector<size_t>& owners = counters[loop.counterOffset];
+            if (!owners.empty() && owners.back() == index)
+                owners.pop_back();
+
+            checks.at(loop.position) = loop.unbalancedNestedAt < loop.rejectedAt ? (uint8_t)UNBALANCED_NESTED_LOOP : loop.rejection;
+
+            // Nested loops must end where they started.
+            if (!loops.empty()) {
+                uint64_t unbalancedAt = balanced ? loop.unbalancedNestedAt : std::min(loop.unbalancedNestedAt, position);
+                loops.back().unbalancedNestedAt = std::min(loops.back().unbalancedNestedAt, unbalancedAt);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    return checks;
+}
+
 std::string removeComments(std::string& source)
 {
     std::string out;
@@ -358,10 +656,36 @@ std::string removeComments(std::string& source)
     return out;
 }
 
-std::vector<uint8_t> compileByteCode(std::string source)
+// Measures the time the callable takes if we collect statistics.
+template <typename F>
+auto timed(CompileStats* stats, uint64_t CompileStats::*nanoseconds, F f)
+{
+    if (stats == nullptr)
+        return f();
+
+    auto start = std::chrono::steady_clock::now();
+    auto result = f();
+    stats->*nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+/**
+ * @brief Compiles the brainfuck source to bytecode.
+ *
+ * @param source
+ * @param stats if not null, statistics about the compilation are collected
+ * into it.
+ * @return the bytecode.
+ */
+std::vector<uint8_t> compileByteCode(std::string source, CompileStats* stats)
 {
-    source = removeComments(source);
+    auto start = std::chrono::steady_clock::now();
 
+    source = timed(stats, &CompileStats::stripNanoseconds, [&]() { return removeComments(source); });
+    if (stats != nullptr)
+        stats->sourceInstructions = source.size();
+
+    std::vector<uint8_t> checks = timed(stats, &CompileStats::matchNanoseconds, [&]() { return checkCountedLoops(source); });
     std::vector<uint8_t> opcodes;
     std::deque<uint64_t> jumpStack;
 
@@ -370,7 +694,7 @@ std::vector<uint8_t> compileByteCode(std::string source)
         case '>': {
             // Maybe, we don't need to do the move here but can defer it until
             // later.
-            if (tryCompileDeferredMoves(source, instructionPointer, opcodes)) {
+            if (timed(stats, &CompileStats::matchNanoseconds, [&]() { return tryCompileDeferredMoves(source, instructionPointer, opcodes, stats); })) {
                 break;
             }
 
@@ -390,7 +714,7 @@ std::vector<uint8_t> compileByteCode(std::string source)
         case '<': {
             // Maybe, we don't need to do the move here but can defer it until
             // later.
-            if (tryCompileDeferredMoves(source, instructionPointer, opcodes)) {
+            if (timed(stats, &CompileStats::matchNanoseconds, [&]() { return tryCompileDeferredMoves(source, instructionPointer, opcodes, stats); })) {
                 break;
             }
 
@@ -445,17 +769,24 @@ std::vector<uint8_t> compileByteCode(std::string source)
             break;
         case '[': {
             // Next, it could also be a multiplication/copy loop.
-            if (tryCompileMultiplyLoop(source, instructionPointer, opcodes)) {
+            if (timed(stats, &CompileStats::matchNanoseconds, [&]() { return tryCompileMultiplyLoop(source, instructionPointer, opcodes, stats); })) {
                 break;
             }
 
             // Since it is not a loop we already detected let's implement a
-            // the default version.
+            // the default version. However, if we already know the trip count
+            // when entering the loop we can emit a counted loop, which doesn't
+            // need to look at the cell on every iteration.
+            bool counted = checks.at(instructionPointer) == COUNTED_LOOP;
+            if (counted && stats != nullptr)
+                stats->countedLoops++;
+            else if (!counted)
+                countRejection(stats, "counted_loop", countedLoopRejections[checks.at(instructionPointer)]);
             jumpStack.push_front(opcodes.size());
 
             // Emit the bytecode to a open jump and an invalid jump target that
             // we will patch later when we find the matching closing bracket.
-            emitByte(opcodes, OP_OPEN);
+            emitByte(opcodes, counted ? OP_COUNT_OPEN : OP_OPEN);
             emitEightBytes(opcodes, 0x0);
             break;
         }
@@ -474,7 +805,8 @@ std::vector<uint8_t> compileByteCode(std::string source)
             patchEightBytes(opcodes, opening + 1, opcodes.size() + 8);
 
             // Emit Opcodes for closing
-            emitByte(opcodes, OP_CLOSE);
+            bool counted = opcodes.at(opening) == OP_COUNT_OPEN;
+            emitByte(opcodes, counted ? OP_COUNT_CLOSE : OP_CLOSE);
             emitEightBytes(opcodes, opening + 8);
             break;
         }
@@ -488,5 +820,12 @@ std::vector<uint8_t> compileByteCode(std::string source)
         exit(1);
     }
 
+    // Everything that isn't stripping comments or pattern matching is
+    // emitting bytecode.
+    if (stats != nullptr) {
+        uint64_t total = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        stats->emitNanoseconds = total - stats->stripNanoseconds - stats->matchNanoseconds;
+    }
+
     return opcodes;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -16,10 +18,34 @@ enum OpCode {
     OP_CLEAR, //    no argument
     OP_MUL, //      2 singed byte arguments, first for the offset and other one for the
             //      factor
+    OP_COUNT_OPEN, //  8 byte argument to indicate the target position, the
+                   //  trip count is the value of the current cell
+    OP_COUNT_CLOSE, // 8 byte argument to indicate the target position
 };
 
-std::vector<uint8_t> compileByteCode(std::string source);
+struct CompileStats {
+    // Number of brainfuck instructions without comments
+    uint64_t sourceInstructions = 0;
+
+    // Time spent in the phases of the compilation
+    uint64_t stripNanoseconds = 0;
+    uint64_t matchNanoseconds = 0;
+    uint64_t emitNanoseconds = 0;
+
+    // How often the patterns were compiled
+    uint64_t clearLoops = 0;
+    uint64_t copyLoops = 0;
+    uint64_t multiplyLoops = 0;
+    uint64_t countedLoops = 0;
+    uint64_t deferredMoves = 0;
+
+    // Why the patterns didn't match, by pattern and reason
+    std::map<std::string, std::map<std::string, uint64_t>> rejections;
+};
+
+std::vector<uint8_t> compileByteCode(std::string source, CompileStats* stats = nullptr);
 void printByteCode(std::vector<uint8_t> opcodes);
+void printStats(CompileStats& stats, std::vector<uint8_t>& opcodes);
 
 void ignoreByteArgument(uint64_t& instructionPointer);
 uint8_t readByteArgument(std::vector<uint8_t>& opcodes, uint64_t& instructionPointer);
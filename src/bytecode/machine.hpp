@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#define TAPE_SIZE 30000
+
+// Everything that is needed to pause the execution of a program and to resume
+// it later on.
+struct Machine {
+    std::vector<uint8_t> tape = std::vector<uint8_t>(TAPE_SIZE, 0);
+    uint64_t dataPointer = 0;
+    // Position of the next instruction to execute
+    uint64_t instructionPointer = 0;
+    // Trip counts of the counted loops we are currently in
+    std::vector<uint8_t> counters;
+    // Budget of bytecode bytes the program may still execute, only used by
+    // metered executions.
+    int64_t fuel = 0;
+    // Number of bytes the program read and wrote so far, only counted by
+    // metered executions since only those take snapshots.
+    uint64_t inputOffset = 0;
+    uint64_t outputOffset = 0;
+};
@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+
+#include "profile.hpp"
+
+// Share of all accesses the hot cells in the summary must cover.
+#define HOT_SHARE 0.9
+
+/**
+ * @brief Exports the profile as three CSV files, PREFIX-cells.csv with the
+ * reads and writes of every touched cell, PREFIX-moves.csv with how often the
+ * data pointer moved by each distance and PREFIX-working-set.csv with the
+ * working set of every window.
+ *
+ * @param prefix
+ * @param profile
+ * @return true if all files were written, otherwise false.
+ */
+bool writeProfile(std::string prefix, TapeProfile& profile)
+{
+    // The last window usually isn't full yet.
+    profile.endWindow();
+
+    std::ofstream cells(prefix + "-cells.csv");
+    cells << "cell,reads,writes\n";
+    for (uint64_t cell = 0; cell < profile.reads.size(); cell++) {
+        if (profile.reads.at(cell) != 0 || profile.writes.at(cell) != 0)
+            cells << cell << "," << profile.reads.at(cell) << "," << profile.writes.at(cell) << "\n";
+    }
+
+    std::ofstream moves(prefix + "-moves.csv");
+    moves << "distance,count\n";
+    for (int distance = -128; distance < 128; distance++) {
+        if (profile.moves.at(distance + 128) != 0)
+            moves << distance << "," << profile.moves.at(distance + 128) << "\n";
+    }
+
+    std::ofstream workingSet(prefix + "-working-set.csv");
+    workingSet << "instructions,cells,min_cell,max_cell\n";
+    for (auto& window : profile.workingSet)
+        workingSet << window.instructions << "," << window.cells << "," << window.minCell << "," << window.maxCell << "\n";
+
+    cells.close();
+    moves.close();
+    workingSet.close();
+    if (!cells || !moves || !workingSet) {
+        std::cerr << "ERROR: Couldn't write profile to " << prefix << "-*.csv" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Prints the numbers needed to size the tape and to tell whether the
+ * hot part of it fits into the caches to stderr.
+ *
+ * @param profile
+ */
+void printProfileSummary(TapeProfile& profile)
+{
+    profile.endWindow();
+
+    std::vector<uint64_t> accesses;
+    uint64_t total = 0;
+    for (uint64_t cell = 0; cell < profile.reads.size(); cell++) {
+        uint64_t n = profile.reads.at(cell) + profile.writes.at(cell);
+        if (n != 0)
+            accesses.push_back(n);
+        total += n;
+    }
+
+    // The fewest cells that take HOT_SHARE of all accesses
+    std::sort(accesses.begin(), accesses.end(), std::greater<uint64_t>());
+    uint64_t hotCells = 0;
+    for (uint64_t covered = 0; hotCells < accesses.size() && covered < total * HOT_SHARE; hotCells++)
+        covered += accesses.at(hotCells);
+
+    uint64_t peakWorkingSet = 0;
+    for (auto& window : profile.workingSet)
+        peakWorkingSet = std::max(peakWorkingSet, window.cells);
+
+    std::cerr << "Instructions:     " << profile.instructions << std::endl;
+    std::cerr << "Tape accesses:    " << total << std::endl;
+    std::cerr << "Cells touched:    " << accesses.size() << std::endl;
+    std::cerr << "Cell range:       " << profile.minCell << " to " << profile.maxCell << std::endl;
+    std::cerr << "Hot cells:        " << hotCells << " (" << (int)(HOT_SHARE * 100) << "% of accesses)" << std::endl;
+    std::cerr << "Peak working set: " << peakWorkingSet << " cells per " << PROFILE_WINDOW << " instructions" << std::endl;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The working set is the number of distinct cells touched while executing
+// this many instructions.
+#define PROFILE_WINDOW (1 << 20)
+
+struct WorkingSetWindow {
+    // Instructions executed when the window ended
+    uint64_t instructions;
+    uint64_t cells;
+    int64_t minCell;
+    int64_t maxCell;
+};
+
+// Records how a program uses its tape, cells are counted from the start of
+// the tape.
+struct TapeProfile {
+    std::vector<uint64_t> reads;
+    std::vector<uint64_t> writes;
+    // Range of the cells the data pointer and all accesses reached
+    int64_t minCell;
+    int64_t maxCell;
+    // Moves by their distance, shifted by 128 so that left moves fit in
+    std::array<uint64_t, 256> moves {};
+    std::vector<WorkingSetWindow> workingSet;
+
+    uint64_t instructions = 0;
+    // The window each cell was touched last in, counting from 1
+    std::vector<uint64_t> lastWindow;
+    uint64_t window = 1;
+    uint64_t windowCells = 0;
+    int64_t windowMin = INT64_MAX;
+    int64_t windowMax = INT64_MIN;
+
+    // Restored programs start at the data pointer of the snapshot.
+    TapeProfile(uint64_t tapeSize, int64_t startCell)
+        : reads(tapeSize, 0)
+        , writes(tapeSize, 0)
+        , minCell(startCell)
+        , maxCell(startCell)
+        , lastWindow(tapeSize, 0)
+    {
+    }
+
+    // Every cell is touched for the first time in some window, so the range
+    // only needs to be updated then.
+    void touch(int64_t cell)
+    {
+        if (lastWindow[cell] != window) {
+            lastWindow[cell] = window;
+            windowCells++;
+            windowMin = std::min(windowMin, cell);
+            windowMax = std::max(windowMax, cell);
+            minCell = std::min(minCell, cell);
+            maxCell = std::max(maxCell, cell);
+        }
+    }
+
+    void read(int64_t cell)
+    {
+        reads[cell]++;
+        touch(cell);
+    }
+
+    void write(int64_t cell)
+    {
+        writes[cell]++;
+        touch(cell);
+    }
+
+    void move(int8_t distance, int64_t cell)
+    {
+        moves[distance + 128]++;
+        minCell = std::min(minCell, cell);
+        maxCell = std::max(maxCell, cell);
+    }
+
+    void step()
+    {
+        if (++instructions % PROFILE_WINDOW == 0)
+            endWindow();
+    }
+
+    void endWindow()
+    {
+        if (windowCells == 0)
+            return;
+
+        workingSet.push_back({ instructions, windowCells, windowMin, windowMax });
+        window++;
+        windowCells = 0;
+        windowMin = INT64_MAX;
+        windowMax = INT64_MIN;
+    }
+};
+
+bool writeProfile(std::string prefix, TapeProfile& profile);
+void printProfileSummary(TapeProfile& profile);
@@ -0,0 +1,351 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+
+#include "interpreter.hpp"
+#include "server.hpp"
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define READ_SIZE 4096
+#define SESSION_SLICE_FUEL (1 << 20)
+
+// Sessions stop running once this much output waits for the client, and we
+// stop reading from the client once this much input waits for the program.
+#define MAX_BUFFERED (1 << 16)
+
+struct Session {
+    int fd;
+    // The whole tape is allocated up front, which limits how many sessions
+    // fit into memory.
+    Machine machine;
+    std::deque<uint8_t> input;
+    std::string output;
+    // Fuel left for the whole session, negative for unlimited
+    int64_t fuel;
+    bool inputClosed = false;
+    bool done = false;
+    // Sessions that ran out of their slice wait in the ready queue for their
+    // next turn and may only be deleted by it.
+    bool ready = false;
+    bool closed = false;
+    // The client has to read some of the output before the session may run
+    // again.
+    bool stalled = false;
+};
+
+// Reads from the input the client sent so far, if the client closed the
+// connection we behave like getchar on EOF.
+struct SessionIO {
+    Session& session;
+
+    bool read(uint8_t& c)
+    {
+        if (session.input.empty()) {
+            if (!session.inputClosed)
+                return false;
+
+            c = (uint8_t)EOF;
+            return true;
+        }
+
+        c = session.input.front();
+        session.input.pop_front();
+        return true;
+    }
+
+    void write(uint8_t c)
+    {
+        session.output += c;
+    }
+};
+
+static void closeSession(int epollFd, Session* session)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, session->fd, nullptr);
+    close(session->fd);
+    session->closed = true;
+    if (!session->ready)
+        delete session;
+}
+
+// Only waits for input if there is room for it, as the sockets are level
+// triggered. A socket the client shut down stays readable, so we stop
+// watching it once we saw the EOF.
+static void watchSession(int epollFd, Session* session)
+{
+    epoll_event event;
+    event.events = 0;
+    if (!session->done && !session->inputClosed && session->input.size() < MAX_BUFFERED)
+        event.events |= EPOLLIN;
+    if (!session->output.empty())
+        event.events |= EPOLLOUT;
+    event.data.ptr = session;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, session->fd, &event);
+}
+
+/**
+ * @brief Sends as much of the pending output as the socket takes and only
+ * waits for the socket to become writable if something is left.
+ *
+ * @param epollFd
+ * @param session
+ * @return false if the session is finished and got closed, otherwise true.
+ */
+static bool flushSession(int epollFd, Session* session)
+{
+    while (!session->output.empty()) {
+        ssize_t n = send(session->fd, session->output.data(), session->output.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            closeSession(epollFd, session);
+            return false;
+        }
+        session->output.erase(0, n);
+    }
+
+    if (session->done && session->output.empty()) {
+        closeSession(epollFd, session);
+        return false;
+    }
+
+    // Finished sessions only wait until they can send the rest.
+    watchSession(epollFd, session);
+    return true;
+}
+
+static void runSession(int epollFd, Session* session, std::vector<uint8_t>& opcodes, std::deque<Session*>& readyQueue)
+{
+    int64_t slice = SESSION_SLICE_FUEL;
+    bool limited = session->fuel >= 0;
+    if (limited && session->fuel < slice)
+        slice = session->fuel;
+
+    SessionIO io { *session };
+    session->machine.fuel = slice;
+    ExitReason reason = interpret<true>(session->machine, opcodes, io);
+    if (limited)
+        session->fuel -= slice - session->machine.fuel;
+
+    if (reason == EXIT_DONE)
+        session->done = true;
+
+    // Sessions that used up all their fuel are stopped for good.
+    if (reason == EXIT_FUEL && limited && session->fuel < 0) {
+        session->done = true;
+        session->output += "ERROR: Out of fuel\n";
+    }
+
+    if (!flushSession(epollFd, session))
+        return;
+
+    // A client that doesn't read must not make us buffer everything the
+    // program writes. Once the output drained the session gets its turn, if
+    // it waits for input it just pauses again.
+    if (!session->done && session->output.size() >= MAX_BUFFERED) {
+        session->stalled = true;
+        return;
+    }
+
+    if (reason == EXIT_FUEL && !session->done) {
+        session->ready = true;
+        readyQueue.push_back(session);
+    }
+}
+
+// Sends the pending output, stalled sessions run again once it drained.
+static bool writeSession(int epollFd, Session* session, std::deque<Session*>& readyQueue)
+{
+    if (!flushSession(epollFd, session))
+        return false;
+
+    if (session->stalled && session->output.size() < MAX_BUFFERED) {
+        session->stalled = false;
+        session->ready = true;
+        readyQueue.push_back(session);
+    }
+    return true;
+}
+
+/**
+ * @brief Accepts all pending connections. If we are out of file descriptors
+ * the connection would stay pending and the listening socket would wake us up
+ * over and over again, so we free the spare descriptor we keep for this case
+ * to accept the connection and drop it right away.
+ *
+ * @param epollFd
+ * @param listenFd
+ * @param spareFd
+ * @param opcodes
+ * @param fuel
+ * @param readyQueue
+ */
+static void acceptSessions(int epollFd, int listenFd, int& spareFd, std::vector<uint8_t>& opcodes, int64_t fuel, std::deque<Session*>& readyQueue)
+{
+    for (;;) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+        if (fd < 0 && (errno == EMFILE || errno == ENFILE) && spareFd >= 0) {
+            close(spareFd);
+            fd = accept(listenFd, nullptr, nullptr);
+            if (fd >= 0)
+                close(fd);
+            spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+            // accept reports running out of descriptors even if there is no
+            // connection waiting.
+            if (fd < 0)
+                return;
+            continue;
+        }
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        Session* session = new Session();
+        session->fd = fd;
+        session->fuel = fuel;
+
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = session;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            delete session;
+            continue;
+        }
+
+        // The program might write something before it reads the first time.
+        runSession(epollFd, session, opcodes, readyQueue);
+    }
+}
+
+static void readSession(int epollFd, Session* session, std::vector<uint8_t>& opcodes, std::deque<Session*>& readyQueue)
+{
+    uint8_t buffer[READ_SIZE];
+    while (session->input.size() < MAX_BUFFERED) {
+        ssize_t n = recv(session->fd, buffer, READ_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (n <= 0) {
+            session->inputClosed = true;
+            break;
+        }
+
+        session->input.insert(session->input.end(), buffer, buffer + n);
+    }
+
+    // The program is already done so we throw away the input.
+    if (session->done) {
+        session->input.clear();
+        flushSession(epollFd, session);
+        return;
+    }
+
+    // The session will see the new input on its next turn anyway.
+    if (session->ready || session->stalled) {
+        watchSession(epollFd, session);
+        return;
+    }
+
+    runSession(epollFd, session, opcodes, readyQueue);
+}
+
+int serve(std::vector<uint8_t>& opcodes, uint16_t port, int64_t fuel)
+{
+    int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listenFd < 0) {
+        std::cerr << "ERROR: Couldn't create socket: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(listenFd, (sockaddr*)&address, sizeof(address)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+        std::cerr << "ERROR: Couldn't listen on port " << port << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    int epollFd = epoll_create1(0);
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+    // Freed to drop connections when we run out of file descriptors
+    int spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    epoll_event events[MAX_EVENTS];
+    std::deque<Session*> readyQueue;
+    for (;;) {
+        // Don't wait for new events if some sessions still want to run.
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, readyQueue.empty() ? -1 : 0);
+        for (int i = 0; i < n; i++) {
+            // The listening socket is the only one without a session
+            Session* session = (Session*)events[i].data.ptr;
+            if (session == nullptr) {
+                acceptSessions(epollFd, listenFd, spareFd, opcodes, fuel, readyQueue);
+                continue;
+            }
+
+            // Nobody is left to read the output, sessions whose client only
+            // stopped sending see EOF instead.
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                closeSession(epollFd, session);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && !writeSession(epollFd, session, readyQueue))
+                continue;
+
+            if (events[i].events & EPOLLIN)
+                readSession(epollFd, session, opcodes, readyQueue);
+        }
+
+        // Give every session that was ready before this round one turn.
+        for (size_t turns = readyQueue.size(); turns > 0; turns--) {
+            Session* session = readyQueue.front();
+            readyQueue.pop_front();
+            session->ready = false;
+            if (session->closed) {
+                delete session;
+                continue;
+            }
+
+            runSession(epollFd, session, opcodes, readyQueue);
+        }
+    }
+}
+
+#else
+
+int serve(std::vector<uint8_t>&, uint16_t, int64_t)
+{
+    std::cerr << "ERROR: Serving programs is only supported on Linux" << std::endl;
+    return 1;
+}
+
+#endif
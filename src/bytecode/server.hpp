@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Serves the program to everyone connecting to the TCP port. Every
+ * connection gets its own session whose input and output is the socket.
+ * All sessions run on the calling thread, a session that waits for input is
+ * paused until data arrives so idle sessions only cost their memory.
+ * Sessions run metered and take turns every SESSION_SLICE_FUEL, so that a
+ * busy session can't starve the others.
+ *
+ * @param opcodes
+ * @param port
+ * @param fuel the fuel of every session, negative for unlimited.
+ * @return never returns on success, otherwise the exit code.
+ */
+int serve(std::vector<uint8_t>& opcodes, uint16_t port, int64_t fuel);
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "snapshot.hpp"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define SNAPSHOT_MAGIC "BFSNAP01"
+
+// Zero runs shorter than this are cheaper to store inside a literal run.
+#define MIN_ZERO_RUN 3
+
+#ifndef _WIN32
+// The child that is still writing a snapshot in the background
+static pid_t backgroundSnapshot = -1;
+#endif
+
+static void writeVarint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+static bool readVarint(std::string& in, uint64_t& pos, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size())
+            return false;
+
+        uint8_t byte = in.at(pos++);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+// FNV-1a, so that we don't restore a snapshot of one program into another.
+static uint64_t hashByteCode(std::vector<uint8_t>& opcodes)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (auto byte : opcodes) {
+        hash ^= byte;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/**
+ * @brief Saves the machine to a snapshot file. Since most of the tape usually
+ * is zero, the tape is stored as pairs of a zero run and a literal run and all
+ * numbers are stored as varints.
+ * The snapshot is written to a temporary file first and then renamed, so that
+ * a crash while saving never destroys the last snapshot.
+ *
+ * @param path
+ * @param machine
+ * @param opcodes
+ * @return true if the snapshot was saved, otherwise false.
+ */
+bool saveSnapshot(std::string path, Machine& machine, std::vector<uint8_t>& opcodes)
+{
+    std::string out = SNAPSHOT_MAGIC;
+    writeVarint(out, hashByteCode(opcodes));
+    writeVarint(out, machine.dataPointer);
+    writeVarint(out, machine.instructionPointer);
+    writeVarint(out, machine.inputOffset);
+    writeVarint(out, machine.outputOffset);
+    writeVarint(out, machine.counters.size());
+    out.append(machine.counters.begin(), machine.counters.end());
+    writeVarint(out, machine.tape.size());
+
+    std::vector<uint8_t>& tape = machine.tape;
+    for (uint64_t pos = 0; pos < tape.size();) {
+        uint64_t zeros = 0;
+        for (; pos + zeros < tape.size() && tape.at(pos + zeros) == 0; zeros++)
+            ;
+        pos += zeros;
+
+        // Extend the literal over short zero runs.
+        uint64_t literal = 0;
+        while (pos + literal < tape.size()) {
+            uint64_t n = 0;
+            for (; pos + literal + n < tape.size() && tape.at(pos + literal + n) == 0 && n < MIN_ZERO_RUN; n++)
+                ;
+            if (n == MIN_ZERO_RUN || pos + literal + n == tape.size())
+                break;
+            literal += n + 1;
+        }
+
+        writeVarint(out, zeros);
+        writeVarint(out, literal);
+        out.append(tape.begin() + pos, tape.begin() + pos + literal);
+        pos += literal;
+    }
+
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    file.close();
+    if (!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Couldn't save snapshot to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Loads the machine from a snapshot file, the snapshot must be taken
+ * from the same program.
+ *
+ * @param path
+ * @param machine
+ * @param opcodes
+ * @return true if the snapshot was loaded, otherwise false.
+ */
+bool loadSnapshot(std::string path, Machine& machine, std::vector<uint8_t>& opcodes)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::string in(static_cast<std::stringstream const&>(std::stringstream() << file.rdbuf()).str());
+
+    uint64_t pos = std::string(SNAPSHOT_MAGIC).size();
+    if (!file || in.compare(0, pos, SNAPSHOT_MAGIC) != 0) {
+        std::cerr << "ERROR: " << path << " is not a snapshot" << std::endl;
+        return false;
+    }
+
+    uint64_t hash, nCounters, tapeSize;
+    bool ok = readVarint(in, pos, hash)
+        && readVarint(in, pos, machine.dataPointer)
+        && readVarint(in, pos, machine.instructionPointer)
+        && readVarint(in, pos, machine.inputOffset)
+        && readVarint(in, pos, machine.outputOffset)
+        && readVarint(in, pos, nCounters)
+        && pos + nCounters <= in.size();
+    if (ok) {
+        machine.counters.assign(in.begin() + pos, in.begin() + pos + nCounters);
+        pos += nCounters;
+        ok = readVarint(in, pos, tapeSize);
+    }
+
+    if (ok && hash != hashByteCode(opcodes)) {
+        std::cerr << "ERROR: " << path << " is a snapshot of another program" << std::endl;
+        return false;
+    }
+
+    if (ok) {
+        machine.tape.assign(tapeSize, 0);
+        for (uint64_t tapePos = 0; ok && tapePos < tapeSize;) {
+            uint64_t zeros, literal;
+            ok = readVarint(in, pos, zeros) && readVarint(in, pos, literal)
+                && tapePos + zeros + literal <= tapeSize && pos + literal <= in.size();
+            if (!ok)
+                break;
+
+            tapePos += zeros;
+            std::copy(in.begin() + pos, in.begin() + pos + literal, machine.tape.begin() + tapePos);
+            tapePos += literal;
+            pos += literal;
+        }
+    }
+
+    if (!ok || machine.dataPointer >= machine.tape.size() || machine.instructionPointer > opcodes.size()) {
+        std::cerr << "ERROR: Snapshot " << path << " is corrupted" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Saves a snapshot in a forked child, so that the program can continue
+ * while the copy-on-write copy of the machine gets written. If the previous
+ * snapshot is still being written we skip this one, since otherwise an older
+ * snapshot could overwrite a newer one.
+ *
+ * @param path
+ * @param machine
+ * @param opcodes
+ */
+void saveSnapshotInBackground(std::string path, Machine& machine, std::vector<uint8_t>& opcodes)
+{
+    // The snapshot counts everything we wrote so far so it must be in the
+    // file before we could crash.
+    std::fflush(stdout);
+
+#ifdef _WIN32
+    saveSnapshot(path, machine, opcodes);
+#else
+    if (backgroundSnapshot > 0) {
+        if (waitpid(backgroundSnapshot, nullptr, WNOHANG) == 0)
+            return;
+        backgroundSnapshot = -1;
+    }
+
+    backgroundSnapshot = fork();
+    if (backgroundSnapshot == 0)
+        _exit(saveSnapshot(path, machine, opcodes) ? 0 : 1);
+
+    if (backgroundSnapshot < 0)
+        saveSnapshot(path, machine, opcodes);
+#endif
+}
+
+/**
+ * @brief Saves a snapshot before the program stops, e.g. because it ran out
+ * of fuel. We wait for the snapshot that is still being written in the
+ * background first, so that it can't overwrite this newer one.
+ *
+ * @param path
+ * @param machine
+ * @param opcodes
+ * @return true if the snapshot was saved.
+ */
+bool saveSnapshotInForeground(std::string path, Machine& machine, std::vector<uint8_t>& opcodes)
+{
+    std::fflush(stdout);
+
+#ifndef _WIN32
+    if (backgroundSnapshot > 0) {
+        waitpid(backgroundSnapshot, nullptr, 0);
+        backgroundSnapshot = -1;
+    }
+#endif
+    return saveSnapshot(path, machine, opcodes);
+}
+
+/**
+ * @brief Brings stdin and stdout to the offsets of the restored machine. We
+ * skip the input the program already read and if stdout is a file that holds
+ * at least the output before the snapshot, we cut off everything written
+ * after it was taken. Shorter files (e.g. a new one) are left alone, so
+ * ftruncate doesn't fill them up with zeros. Pipes and terminals can't be
+ * rewound, so they just continue.
+ *
+ * @param machine
+ */
+void restoreStandardStreams(Machine& machine)
+{
+#ifndef _WIN32
+    if (lseek(STDIN_FILENO, machine.inputOffset, SEEK_SET) < 0) {
+        for (uint64_t i = 0; i < machine.inputOffset && std::getchar() != EOF; i++)
+            ;
+    }
+
+    struct stat info;
+    if (fstat(STDOUT_FILENO, &info) == 0 && S_ISREG(info.st_mode) && (uint64_t)info.st_size >= machine.outputOffset) {
+        std::fflush(stdout);
+        if (ftruncate(STDOUT_FILENO, machine.outputOffset) == 0)
+            lseek(STDOUT_FILENO, machine.outputOffset, SEEK_SET);
+    }
+#else
+    for (uint64_t i = 0; i < machine.inputOffset && std::getchar() != EOF; i++)
+        ;
+#endif
+}
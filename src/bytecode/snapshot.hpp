@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "machine.hpp"
+
+bool saveSnapshot(std::string path, Machine& machine, std::vector<uint8_t>& opcodes);
+bool loadSnapshot(std::string path, Machine& machine, std::vector<uint8_t>& opcodes);
+void saveSnapshotInBackground(std::string path, Machine& machine, std::vector<uint8_t>& opcodes);
+bool saveSnapshotInForeground(std::string path, Machine& machine, std::vector<uint8_t>& opcodes);
+void restoreStandardStreams(Machine& machine);
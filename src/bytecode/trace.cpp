@@ -0,0 +1,358 @@
+#include "trace.hpp"
+#include "libbytecode.hpp"
+
+Tracer::Tracer(std::vector<uint8_t>& opcodes)
+    : opcodes(opcodes)
+    , hotness(opcodes.size() + 1, 0)
+    , aborts(opcodes.size() + 1, 0)
+    , traceIndex(opcodes.size() + 1, -1)
+{
+}
+
+/**
+ * @brief Called when the interpreter enters a loop.
+ *
+ * @param head the position of the first instruction of the loop body.
+ * @return the trace of the loop, or nullptr if there is none.
+ */
+Trace* Tracer::atLoopEntry(uint64_t head)
+{
+    if (recording || traceIndex.at(head) < 0)
+        return nullptr;
+    return enter(head);
+}
+
+/**
+ * @brief Called when the interpreter jumps back to the start of a loop. Loops
+ * that do this often enough start getting recorded.
+ *
+ * @param head the position of the first instruction of the loop body.
+ * @return the trace of the loop, or nullptr if there is none.
+ */
+Trace* Tracer::atBackEdge(uint64_t head)
+{
+    if (recording)
+        return nullptr;
+
+    if (traceIndex.at(head) >= 0)
+        return enter(head);
+
+    if (aborts.at(head) < MAX_TRACE_ABORTS && ++hotness.at(head) >= HOT_LOOP)
+        startRecording(head);
+    return nullptr;
+}
+
+// Compiles the trace once it ran often enough.
+Trace* Tracer::enter(uint64_t head)
+{
+    Trace& trace = traces.at(traceIndex.at(head));
+    if (compile && trace.runs < HOT_TRACE && ++trace.runs == HOT_TRACE)
+        trace.native = compile(trace);
+    return &trace;
+}
+
+void Tracer::startRecording(uint64_t head)
+{
+    recording = true;
+    current = Trace { head, {}, {} };
+    base = 0;
+    recorded = 0;
+    skipUntil = 0;
+    innerIterations.clear();
+}
+
+void Tracer::abortRecording()
+{
+    recording = false;
+    aborts.at(current.head)++;
+    hotness.at(current.head) = 0;
+}
+
+void Tracer::finishRecording(bool loops)
+{
+    recording = false;
+
+    // A trace that exits right away would only slow us down.
+    if (!loops && current.ops.size() <= 1) {
+        abortRecording();
+        return;
+    }
+
+    traceIndex.at(current.head) = traces.size();
+    traces.push_back(optimizeTrace(current));
+}
+
+uint32_t Tracer::addExit(uint64_t instructionPointer)
+{
+    current.exits.push_back({ instructionPointer, base, {} });
+    return current.exits.size() - 1;
+}
+
+void Tracer::append(TraceOpKind kind, int32_t offset, uint8_t value, uint32_t exit, int32_t source)
+{
+    current.ops.push_back({ kind, offset, source, value, 0, exit });
+}
+
+/**
+ * @brief Records the instruction the interpreter is about to execute. Moves
+ * only change the offset of the following instructions and branches become
+ * guards that the same path is taken again.
+ *
+ * @param instructionPointer
+ * @param dataPointer
+ * @param counters
+ */
+void Tracer::record(uint64_t instructionPointer, uint8_t* dataPointer, std::vector<uint8_t>& counters)
+{
+    // The iterations of scans are run by a single op.
+    if (skipUntil != 0) {
+        if (instructionPointer < skipUntil)
+            return;
+        skipUntil = 0;
+    }
+
+    uint64_t position = instructionPointer;
+    if (++recorded > MAX_TRACE_LENGTH) {
+        append(TRACE_EXIT, 0, 0, addExit(position));
+        finishRecording(false);
+        return;
+    }
+
+    switch (opcodes.at(instructionPointer)) {
+    case OP_MOVE:
+        base += (int8_t)readByteArgument(opcodes, instructionPointer);
+        break;
+
+    case OP_INC: {
+        int8_t offset = readByteArgument(opcodes, instructionPointer);
+        int8_t increment = readByteArgument(opcodes, instructionPointer);
+        append(TRACE_ADD, base + offset, increment);
+        break;
+    }
+
+    case OP_CLEAR:
+        append(TRACE_SET, base, 0);
+        break;
+
+    case OP_MUL: {
+        int8_t offset = readByteArgument(opcodes, instructionPointer);
+        int8_t factor = readByteArgument(opcodes, instructionPointer);
+        append(TRACE_MUL, base + offset, factor, 0, base);
+        break;
+    }
+
+    case OP_WRITE:
+        append(TRACE_WRITE, base);
+        break;
+
+    case OP_READ:
+        append(TRACE_READ, base, 0, addExit(position));
+        break;
+
+    case OP_OPEN:
+    case OP_COUNT_OPEN: {
+        bool counted = opcodes.at(position) == OP_COUNT_OPEN;
+        uint64_t argument = readEightByteArgument(opcodes, instructionPointer);
+
+        // Loops like [>>] whose body is a single move. Only loops that are
+        // that short can be one, so we check the length before the body.
+        uint64_t move = position + 9;
+        if (!counted && argument == position + 19 && opcodes.at(move) == OP_MOVE) {
+            int8_t distance = readByteArgument(opcodes, move);
+            append(TRACE_SCAN, base, distance);
+            base = 0;
+            skipUntil = argument + 1;
+            break;
+        }
+
+        if (*dataPointer == 0) {
+            append(TRACE_GUARD_ZERO, base, 0, addExit(position));
+            break;
+        }
+
+        append(TRACE_GUARD_NONZERO, base, 0, addExit(position));
+        if (counted)
+            append(TRACE_COUNT_PUSH, base);
+        break;
+    }
+
+    case OP_CLOSE:
+    case OP_COUNT_CLOSE: {
+        bool counted = opcodes.at(position) == OP_COUNT_CLOSE;
+        uint64_t head = readEightByteArgument(opcodes, instructionPointer) + 1;
+        bool taken = counted ? counters.back() != 1 : *dataPointer != 0;
+
+        // The trace must loop, otherwise it isn't worth it.
+        if (!taken && head == current.head) {
+            abortRecording();
+            return;
+        }
+
+        // Stop before inner loops that don't end soon, they get their own
+        // trace.
+        if (taken && head != current.head && ++innerIterations[head] > MAX_INNER_UNROLL) {
+            append(TRACE_EXIT, 0, 0, addExit(position));
+            finishRecording(false);
+            return;
+        }
+
+        if (!taken)
+            innerIterations.erase(head);
+
+        if (counted) {
+            append(taken ? TRACE_COUNT_LOOP : TRACE_COUNT_DONE, 0, 0, addExit(position));
+        } else {
+            append(taken ? TRACE_GUARD_NONZERO : TRACE_GUARD_ZERO, base, 0, addExit(position));
+        }
+
+        if (taken && head == current.head) {
+            append(TRACE_LOOP, base);
+            finishRecording(true);
+        }
+        break;
+    }
+    }
+}
+
+// What the optimizer knows about a cell
+struct CellState {
+    // The value of the cell is known
+    bool known = false;
+    uint8_t value = 0;
+    // A store that wasn't written to the tape yet, either setting the cell
+    // or adding to it.
+    bool pending = false;
+    bool pendingSet = false;
+    uint8_t pendingValue = 0;
+};
+
+/**
+ * @brief Optimizes a recorded trace. Stores are delayed until the cell gets
+ * read, which merges and removes most of them. Stores that are still pending
+ * when a guard fails are written by the exit. Known values are propagated, so
+ * guards on them and multiplications with them disappear.
+ *
+ * @param trace
+ * @return the optimized trace.
+ */
+Trace optimizeTrace(Trace& trace)
+{
+    Trace out { trace.head, {}, {} };
+    std::map<int32_t, CellState> cells;
+
+    auto flush = [&](int32_t offset) {
+        CellState& cell = cells[offset];
+        if (cell.pending && (cell.pendingSet || cell.pendingValue != 0))
+            out.ops.push_back({ cell.pendingSet ? TRACE_SET : TRACE_ADD, offset, 0, cell.pendingValue, 0, 0 });
+        cell.pending = false;
+    };
+
+    auto flushAll = [&]() {
+        for (auto& [offset, cell] : cells)
+            flush(offset);
+    };
+
+    auto add = [&](int32_t offset, uint8_t value) {
+        CellState& cell = cells[offset];
+        if (cell.known) {
+            cell.value += value;
+            cell.pending = true;
+            cell.pendingSet = true;
+            cell.pendingValue = cell.value;
+        } else if (cell.pending) {
+            cell.pendingValue += value;
+        } else {
+            cell.pending = true;
+            cell.pendingSet = false;
+            cell.pendingValue = value;
+        }
+    };
+
+    // Unknown cells might still have an add pending, which reads add.
+    auto addend = [&](int32_t offset) -> uint8_t {
+        CellState& cell = cells[offset];
+        return cell.pending ? cell.pendingValue : 0;
+    };
+
+    auto addExit = [&](uint32_t exit) {
+        TraceExit e = trace.exits.at(exit);
+        for (auto& [offset, cell] : cells) {
+            if (cell.pending && (cell.pendingSet || cell.pendingValue != 0))
+                e.writes.push_back({ offset, cell.pendingSet, cell.pendingValue });
+        }
+        out.exits.push_back(e);
+        return (uint32_t)out.exits.size() - 1;
+    };
+
+    for (auto& op : trace.ops) {
+        switch (op.kind) {
+        case TRACE_ADD:
+            add(op.offset, op.value);
+            break;
+
+        case TRACE_SET: {
+            CellState& cell = cells[op.offset];
+            cell.known = true;
+            cell.value = op.value;
+            cell.pending = true;
+            cell.pendingSet = true;
+            cell.pendingValue = op.value;
+            break;
+        }
+
+        case TRACE_MUL: {
+            CellState& source = cells[op.source];
+            if (source.known) {
+                add(op.offset, source.value * op.value);
+                break;
+            }
+
+            // Adds commute, so an add pending on the target can stay pending.
+            CellState& target = cells[op.offset];
+            if (target.known) {
+                flush(op.offset);
+                target.known = false;
+            }
+            out.ops.push_back({ TRACE_MUL, op.offset, op.source, op.value, addend(op.source), 0 });
+            break;
+        }
+
+        case TRACE_WRITE:
+        case TRACE_COUNT_PUSH:
+            if (cells[op.offset].known)
+                flush(op.offset);
+            out.ops.push_back({ op.kind, op.offset, 0, 0, addend(op.offset), 0 });
+            break;
+
+        case TRACE_READ: {
+            uint32_t exit = addExit(op.exit);
+            out.ops.push_back({ TRACE_READ, op.offset, 0, 0, 0, exit });
+            cells[op.offset] = CellState();
+            break;
+        }
+
+        case TRACE_GUARD_ZERO:
+        case TRACE_GUARD_NONZERO:
+            // The recorded path already checked known values.
+            if (cells[op.offset].known)
+                break;
+            out.ops.push_back({ op.kind, op.offset, 0, 0, addend(op.offset), addExit(op.exit) });
+            break;
+
+        case TRACE_COUNT_LOOP:
+        case TRACE_COUNT_DONE:
+        case TRACE_EXIT:
+            out.ops.push_back({ op.kind, 0, 0, 0, 0, addExit(op.exit) });
+            break;
+
+        case TRACE_SCAN:
+        case TRACE_LOOP:
+            // We don't know where the data pointer ends up after scans.
+            flushAll();
+            cells.clear();
+            out.ops.push_back(op);
+            break;
+        }
+    }
+    return out;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "machine.hpp"
+
+// Number of back-edges after which a loop is hot and gets traced.
+#define HOT_LOOP 56
+
+// Longest trace we record, in executed bytecode instructions. Longer paths
+// end the trace with an exit to the interpreter.
+#define MAX_TRACE_LENGTH 1024
+
+// How often a trace may iterate an inner loop before we stop it there, the
+// inner loop then gets a trace of its own.
+#define MAX_INNER_UNROLL 8
+
+// Loops whose traces got aborted this often are never traced again.
+#define MAX_TRACE_ABORTS 4
+
+// How often a trace runs before it gets compiled to native code, compiling
+// takes longer than most traces ever run.
+#define HOT_TRACE 1024
+
+enum TraceOpKind {
+    TRACE_ADD, //        cell += value
+    TRACE_SET, //        cell = value
+    TRACE_MUL, //        cell += (source cell + addend) * value
+    TRACE_WRITE, //      writes cell + addend
+    TRACE_READ, //       reads into cell, exits if there is no input
+    TRACE_GUARD_ZERO, // exits unless cell + addend is zero
+    TRACE_GUARD_NONZERO, // exits unless cell + addend is not zero
+    TRACE_COUNT_PUSH, // starts a counted loop with cell + addend iterations
+    TRACE_COUNT_LOOP, // exits unless the counted loop has iterations left
+    TRACE_COUNT_DONE, // exits unless the counted loop is done
+    TRACE_SCAN, //       moves by offset, then by value until the cell is zero
+    TRACE_LOOP, //       moves by offset and starts over
+    TRACE_EXIT, //       always exits
+};
+
+// Cells are addressed by their offset from the data pointer at the start of
+// the trace, or since the last scan.
+struct TraceOp {
+    TraceOpKind kind;
+    int32_t offset;
+    int32_t source;
+    uint8_t value;
+    uint8_t addend;
+    uint32_t exit;
+};
+
+// A store that is still pending when the trace exits.
+struct PendingWrite {
+    int32_t offset;
+    bool set;
+    uint8_t value;
+};
+
+// Where the interpreter continues if a guard fails. The interpreter
+// re-executes the guarded instruction, so all guards come before the
+// instruction has any effect.
+struct TraceExit {
+    uint64_t instructionPointer;
+    int32_t offset;
+    std::vector<PendingWrite> writes;
+};
+
+// A trace compiled to native code. It runs until a guard fails, moves the
+// data pointer to where the interpreter continues and returns the position
+// of the instruction to continue with. It does its I/O with getchar and
+// putchar.
+typedef uint64_t (*NativeTrace)(uint8_t** dataPointer, std::vector<uint8_t>* counters);
+
+struct Trace {
+    uint64_t head;
+    std::vector<TraceOp> ops;
+    std::vector<TraceExit> exits;
+    NativeTrace native = nullptr;
+    uint32_t runs = 0;
+};
+
+class Tracer {
+public:
+    Tracer(std::vector<uint8_t>& opcodes);
+
+    Trace* atLoopEntry(uint64_t head);
+    Trace* atBackEdge(uint64_t head);
+    void record(uint64_t instructionPointer, uint8_t* dataPointer, std::vector<uint8_t>& counters);
+
+    bool recording = false;
+
+    // Compiles hot traces to native code if set, the trace stays
+    // interpreted if it returns nullptr.
+    std::function<NativeTrace(Trace&)> compile;
+
+private:
+    Trace* enter(uint64_t head);
+    void startRecording(uint64_t head);
+    void abortRecording();
+    void finishRecording(bool loops);
+    uint32_t addExit(uint64_t instructionPointer);
+    void append(TraceOpKind kind, int32_t offset, uint8_t value = 0, uint32_t exit = 0, int32_t source = 0);
+
+    std::vector<uint8_t>& opcodes;
+    std::vector<uint16_t> hotness;
+    std::vector<uint8_t> aborts;
+    // The trace of every loop head, or -1
+    std::vector<int32_t> traceIndex;
+    std::vector<Trace> traces;
+
+    // The trace being recorded
+    Trace current;
+    int32_t base = 0;
+    uint64_t recorded = 0;
+    uint64_t skipUntil = 0;
+    std::map<uint64_t, int> innerIterations;
+};
+
+Trace optimizeTrace(Trace& trace);
+
+/**
+ * @brief Runs the trace until one of its guards fails. The trace keeps no
+ * state of its own, so the interpreter can continue right where the trace
+ * exited.
+ *
+ * @param trace
+ * @param dataPointer
+ * @param machine
+ * @param io
+ * @return the position of the instruction the interpreter has to continue
+ * with.
+ */
+template <typename IO>
+uint64_t runTrace(Trace& trace, uint8_t*& dataPointer, Machine& machine, IO& io)
+{
+    if (trace.native != nullptr)
+        return trace.native(&dataPointer, &machine.counters);
+
+    uint8_t* p = dataPointer;
+    std::vector<uint8_t>& counters = machine.counters;
+    const TraceOp* ops = trace.ops.data();
+    const TraceOp* op = ops;
+    for (;; op++) {
+        switch (op->kind) {
+        case TRACE_ADD:
+            p[op->offset] += op->value;
+            continue;
+
+        case TRACE_SET:
+            p[op->offset] = op->value;
+            continue;
+
+        case TRACE_MUL:
+            p[op->offset] += (uint8_t)(p[op->source] + op->addend) * op->value;
+            continue;
+
+        case TRACE_WRITE:
+            io.write(p[op->offset] + op->addend);
+            continue;
+
+        case TRACE_READ:
+            if (!io.read(p[op->offset]))
+                break;
+            continue;
+
+        case TRACE_GUARD_ZERO:
+            if ((uint8_t)(p[op->offset] + op->addend) != 0)
+                break;
+            continue;
+
+        case TRACE_GUARD_NONZERO:
+            if ((uint8_t)(p[op->offset] + op->addend) == 0)
+                break;
+            continue;
+
+        case TRACE_COUNT_PUSH:
+            counters.push_back(p[op->offset] + op->addend);
+            continue;
+
+        case TRACE_COUNT_LOOP:
+            if (counters.back() == 1)
+                break;
+            counters.back()--;
+            continue;
+
+        case TRACE_COUNT_DONE:
+            if (counters.back() != 1)
+                break;
+            counters.pop_back();
+            continue;
+
+        case TRACE_SCAN:
+            p += op->offset;
+            while (*p != 0)
+                p += (int8_t)op->value;
+            continue;
+
+        case TRACE_LOOP:
+            p += op->offset;
+            op = ops - 1;
+            continue;
+
+        case TRACE_EXIT:
+            break;
+        }
+
+        // Only exits get here, they write the stores the trace delayed.
+        TraceExit& exit = trace.exits[op->exit];
+        for (auto& write : exit.writes) {
+            if (write.set)
+                p[write.offset] = write.value;
+            else
+                p[write.offset] += write.value;
+        }
+        dataPointer = p + exit.offset;
+        return exit.instructionPointer;
+    }
+}
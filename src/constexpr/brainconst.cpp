@@ -0,0 +1,38 @@
+#include <iostream>
+#include <string>
+
+#include "brainconst.hpp"
+#include "examples.hpp"
+
+// The programs are compiled into this binary, so we pick them by the name of
+// the file given, just like the other engines would read them.
+struct Example {
+    const char* name;
+    void (*run)();
+};
+
+static const Example EXAMPLES[] = {
+    { "helloworld.bf", bf::compiled<EXAMPLE_HELLOWORLD>::run },
+    { "99bottles.bf", bf::compiled<EXAMPLE_99BOTTLES>::run },
+    { "mandelbrot.bf", bf::compiled<EXAMPLE_MANDELBROT>::run },
+};
+
+int main(int argc, char const* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " helloworld.bf|99bottles.bf|mandelbrot.bf" << std::endl;
+        exit(1);
+    }
+
+    std::string path = argv[argc - 1];
+    std::string name = path.substr(path.find_last_of("/\\") + 1);
+    for (auto& example : EXAMPLES) {
+        if (name == example.name) {
+            example.run();
+            return 0;
+        }
+    }
+
+    std::cerr << "ERROR: " << name << " is not compiled into brainconst" << std::endl;
+    exit(1);
+}
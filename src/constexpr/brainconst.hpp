@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+#include <utility>
+
+// A header-only brainfuck compiler that runs entirely at C++ compile time. The
+// program is parsed and optimized with the same patterns libbytecode detects,
+// but instead of bytecode every instruction becomes a template instantiation,
+// so the C++ compiler can inline and optimize the whole program like
+// handwritten code.
+//
+// Usage:
+//   bf::compiled<"++++++++[>++++++++<-]>+.">::run();
+//
+// Unbalanced brackets are reported as errors at compile time. The source is
+// part of every instantiated name, so compile time grows with the product of
+// source size and instruction count, programs with tens of thousands of
+// instructions take minutes to compile.
+
+#define BF_TAPE_SIZE 30000
+
+// Maximum nesting of loops inside counted loop candidates, deeper loops are
+// just compiled as regular loops.
+#define BF_MAX_NESTING 256
+
+// Number of instructions per fold expression, as compilers limit how deeply
+// expressions can be nested.
+#define BF_CHUNK_SIZE 64
+
+namespace bf {
+
+template <size_t N>
+struct fixed_string {
+    char data[N];
+
+    constexpr fixed_string(const char (&str)[N])
+    {
+        std::copy_n(str, N, data);
+    }
+
+    constexpr std::string_view view() const
+    {
+        return std::string_view(data, N - 1);
+    }
+};
+
+enum class Kind : uint8_t {
+    Move, //       offset is how far to move
+    Inc, //        arg is added to the cell at offset
+    Write,
+    Read,
+    Open, //       match is the index of the closing instruction
+    Close, //      match is the index of the opening instruction
+    CountOpen, //  like Open, but the trip count is the value of the cell
+    Clear,
+    Mul, //        the cell times arg is added to the cell at offset
+};
+
+struct Op {
+    Kind kind = Kind::Move;
+    int32_t offset = 0;
+    int32_t arg = 0;
+    uint32_t match = 0;
+    // The instructions directly inside of a loop, or of the program for the
+    // last op, are children[firstChild, firstChild + nChildren).
+    uint32_t firstChild = 0;
+    uint32_t nChildren = 0;
+};
+
+template <size_t N>
+struct Program {
+    // The ops end with one extra op for the whole program.
+    std::array<Op, N + 1> ops {};
+    std::array<uint32_t, N> children {};
+    size_t size = 0;
+};
+
+namespace detail {
+
+    constexpr bool isInstruction(char c)
+    {
+        return c == '>' || c == '<' || c == '+' || c == '-' || c == '.' || c == ',' || c == '[' || c == ']';
+    }
+
+    constexpr bool isArithmetic(char c)
+    {
+        return c == '>' || c == '<' || c == '+' || c == '-';
+    }
+
+    template <size_t N>
+    struct Source {
+        std::array<char, N> data {};
+        size_t size = 0;
+
+        constexpr char at(size_t i) const
+        {
+            return i < size ? data[i] : '\0';
+        }
+    };
+
+    template <size_t N>
+    constexpr Source<N> removeComments(std::string_view source)
+    {
+        Source<N> out;
+        for (char c : source) {
+            if (isInstruction(c))
+                out.data[out.size++] = c;
+        }
+        return out;
+    }
+
+    // Adds the increment to the op of the kind at the offset, or appends a
+    // new one, but only searches the ops from first on.
+    template <size_t N>
+    constexpr void addAt(Program<N>& program, size_t first, Kind kind, int32_t offset, int32_t increment)
+    {
+        for (size_t i = first; i < program.size; i++) {
+            if (program.ops[i].kind == kind && program.ops[i].offset == offset) {
+                program.ops[i].arg += increment;
+                return;
+            }
+        }
+        program.ops[program.size++] = Op { kind, offset, increment, 0 };
+    }
+
+    // Merges a run of >, <, + and - into increments with offsets and a single
+    // move at the end (deferred moves in libbytecode).
+    template <size_t N, size_t M>
+    constexpr size_t compileArithmetic(const Source<M>& source, size_t i, Program<N>& program)
+    {
+        size_t first = program.size;
+        int32_t offset = 0;
+        for (; isArithmetic(source.at(i)); i++) {
+            switch (source.at(i)) {
+            case '>':
+                offset++;
+                break;
+            case '<':
+                offset--;
+                break;
+            case '+':
+                addAt(program, first, Kind::Inc, offset, 1);
+                break;
+            case '-':
+                addAt(program, first, Kind::Inc, offset, -1);
+                break;
+            }
+        }
+
+        // Drop increments that cancel out
+        size_t kept = first;
+        for (size_t j = first; j < program.size; j++) {
+            if ((uint8_t)program.ops[j].arg != 0)
+                program.ops[kept++] = program.ops[j];
+        }
+        program.size = kept;
+
+        if (offset != 0)
+            program.ops[program.size++] = Op { Kind::Move, offset, 0, 0 };
+        return i;
+    }
+
+    // Multiply loops only contain arithmetic, end where they started and
+    // decrement the cell they started at by one.
+    template <size_t N, size_t M>
+    constexpr bool tryCompileMultiplyLoop(const Source<M>& source, size_t& i, Program<N>& program)
+    {
+        size_t end = i + 1;
+        int32_t offset = 0;
+        int32_t counter = 0;
+        for (; isArithmetic(source.at(end)); end++) {
+            char c = source.at(end);
+            offset += c == '>' ? 1 : c == '<' ? -1 : 0;
+            if (offset == 0)
+                counter += c == '+' ? 1 : c == '-' ? -1 : 0;
+        }
+
+        if (source.at(end) != ']' || offset != 0 || (uint8_t)counter != UINT8_MAX)
+            return false;
+
+        size_t first = program.size;
+        offset = 0;
+        for (size_t j = i + 1; j < end; j++) {
+            char c = source.at(j);
+            offset += c == '>' ? 1 : c == '<' ? -1 : 0;
+            if (offset != 0 && (c == '+' || c == '-'))
+                addAt(program, first, Kind::Mul, offset, c == '+' ? 1 : -1);
+        }
+
+        program.ops[program.size++] = Op { Kind::Clear };
+        i = end + 1;
+        return true;
+    }
+
+    // Counted loops decrement the cell they started at by exactly one per
+    // iteration, don't touch it otherwise and only contain balanced loops.
+    template <size_t M>
+    constexpr bool isCountedLoop(const Source<M>& source, size_t i)
+    {
+        int32_t offsets[BF_MAX_NESTING] {};
+        size_t nesting = 0;
+        int32_t offset = 0;
+        int32_t counter = 0;
+        for (i++; i < source.size; i++) {
+            switch (source.at(i)) {
+            case '>':
+                offset++;
+                break;
+            case '<':
+                offset--;
+                break;
+            case '+':
+            case '-':
+                if (offset != 0)
+                    break;
+                if (nesting > 0)
+                    return false;
+                counter += source.at(i) == '+' ? 1 : -1;
+                break;
+            case ',':
+                if (offset == 0)
+                    return false;
+                break;
+            case '[':
+                if (nesting == BF_MAX_NESTING)
+                    return false;
+                offsets[nesting++] = offset;
+                break;
+            case ']':
+                if (nesting == 0)
+                    return offset == 0 && (uint8_t)counter == UINT8_MAX;
+                if (offsets[--nesting] != offset)
+                    return false;
+                break;
+            }
+        }
+        return false;
+    }
+
+    // Groups the instructions by the loop they are directly in, so that the
+    // code generation only has to look at every instruction once.
+    template <size_t N>
+    constexpr void collectChildren(Program<N>& program)
+    {
+        Op& root = program.ops[program.size];
+        root.match = program.size;
+
+        // Count the children of every loop first, then give every loop its
+        // range of children.
+        uint32_t parents[N + 1] {};
+        size_t parent = program.size;
+        for (size_t i = 0; i < program.size; i++) {
+            Op& op = program.ops[i];
+            if (op.kind == Kind::Close) {
+                parent = parents[op.match];
+                continue;
+            }
+
+            parents[i] = parent;
+            program.ops[parent].nChildren++;
+            if (op.kind == Kind::Open || op.kind == Kind::CountOpen)
+                parent = i;
+        }
+
+        uint32_t next = 0;
+        for (size_t i = 0; i <= program.size; i++) {
+            program.ops[i].firstChild = next;
+            next += program.ops[i].nChildren;
+            program.ops[i].nChildren = 0;
+        }
+
+        for (size_t i = 0; i < program.size; i++) {
+            if (program.ops[i].kind == Kind::Close)
+                continue;
+
+            Op& op = program.ops[parents[i]];
+            program.children[op.firstChild + op.nChildren++] = i;
+        }
+    }
+
+    template <size_t N>
+    constexpr Program<N> compile(std::string_view text)
+    {
+        auto source = removeComments<N>(text);
+        Program<N> program;
+
+        // The open loops are a stack threaded through the match fields of
+        // their opening instructions.
+        uint32_t open = UINT32_MAX;
+        for (size_t i = 0; i < source.size;) {
+            char c = source.at(i);
+            if (isArithmetic(c)) {
+                i = compileArithmetic(source, i, program);
+                continue;
+            }
+
+            switch (c) {
+            case '.':
+                program.ops[program.size++] = Op { Kind::Write };
+                break;
+            case ',':
+                program.ops[program.size++] = Op { Kind::Read };
+                break;
+            case '[': {
+                if (tryCompileMultiplyLoop(source, i, program))
+                    continue;
+
+                Kind kind = isCountedLoop(source, i) ? Kind::CountOpen : Kind::Open;
+                program.ops[program.size] = Op { kind, 0, 0, open };
+                open = program.size++;
+                break;
+            }
+            case ']': {
+                if (open == UINT32_MAX)
+                    throw "Couldn't find matching '['";
+
+                uint32_t opening = open;
+                open = program.ops[opening].match;
+                program.ops[opening].match = program.size;
+                program.ops[program.size++] = Op { Kind::Close, 0, 0, opening };
+                break;
+            }
+            }
+            i++;
+        }
+
+        if (open != UINT32_MAX)
+            throw "Couldn't find matching ']'";
+
+        collectChildren(program);
+        return program;
+    }
+
+} // namespace detail
+
+template <fixed_string Source>
+struct compiled {
+    static constexpr auto program = detail::compile<sizeof(Source.data)>(Source.view());
+
+    /**
+     * @brief Runs the program on the tape with stdin and stdout as I/O.
+     *
+     * @param tape must be large enough for the program, cells left of the
+     * start are never checked either.
+     */
+    static void run(uint8_t* tape)
+    {
+        block<program.size>(tape);
+    }
+
+    /**
+     * @brief Runs the program on a fresh tape of BF_TAPE_SIZE cells.
+     */
+    static void run()
+    {
+        static uint8_t tape[BF_TAPE_SIZE];
+        std::fill_n(tape, BF_TAPE_SIZE, 0);
+        run(tape);
+    }
+
+private:
+    // Runs the instructions directly inside of the loop, or of the whole
+    // program. Long blocks are split in chunks.
+    template <size_t Loop, size_t Begin = 0, size_t End = program.ops[Loop].nChildren>
+    static uint8_t* block(uint8_t* p)
+    {
+        constexpr size_t first = program.ops[Loop].firstChild;
+        if constexpr (End - Begin <= BF_CHUNK_SIZE) {
+            return [&]<size_t... Is>(std::index_sequence<Is...>) {
+                ((p = step<program.children[first + Begin + Is]>(p)), ...);
+                return p;
+            }(std::make_index_sequence<End - Begin>());
+        } else {
+            constexpr size_t middle = Begin + (End - Begin) / 2;
+            p = block<Loop, Begin, middle>(p);
+            return block<Loop, middle, End>(p);
+        }
+    }
+
+    template <size_t I>
+    static uint8_t* step(uint8_t* p)
+    {
+        constexpr Op op = program.ops[I];
+        if constexpr (op.kind == Kind::Move) {
+            return p + op.offset;
+        } else if constexpr (op.kind == Kind::Inc) {
+            p[op.offset] += op.arg;
+            return p;
+        } else if constexpr (op.kind == Kind::Write) {
+            std::putchar(*p);
+            return p;
+        } else if constexpr (op.kind == Kind::Read) {
+            *p = std::getchar();
+            return p;
+        } else if constexpr (op.kind == Kind::Clear) {
+            *p = 0;
+            return p;
+        } else if constexpr (op.kind == Kind::Mul) {
+            p[op.offset] += *p * op.arg;
+            return p;
+        } else if constexpr (op.kind == Kind::Open) {
+            while (*p)
+                p = block<I>(p);
+            return p;
+        } else {
+            for (uint8_t n = *p; n != 0; n--)
+                p = block<I>(p);
+            return p;
+        }
+    }
+};
+
+} // namespace bf
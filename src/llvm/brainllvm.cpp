@@ -1,16 +1,25 @@
+#include <atomic>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
+#include "interpreter.hpp"
 #include "libbytecode.hpp"
+#include "machine.hpp"
+#include "trace.hpp"
 
-#include "llvm/ADT/APFloat.h"
-#include "llvm/ADT/STLExtras.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -20,101 +29,675 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TargetSelect.h"
 
-int main(int argc, char const* argv[])
+// Loops larger than this many bytes of bytecode get their own function, and
+// once a function has that much code the rest of it moves into another one.
+// This keeps every function small enough for LLVM to compile it quickly.
+#define OUTLINE_SIZE 1024
+
+static llvm::ExitOnError exitOnError("ERROR: ");
+
+// Every function lives in its own module and context, so that ORC can
+// optimize and compile them on different threads at the same time.
+struct FunctionBuilder {
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::unique_ptr<llvm::Module> module;
+    std::unique_ptr<llvm::IRBuilder<>> builder;
+    llvm::Function* function;
+    // Stack slot of the data pointer, mem2reg turns it into a register
+    llvm::Value* dataPointer;
+    // Bytes of bytecode compiled into this function so far
+    uint64_t size = 0;
+    // All loops of the top level code get their own function
+    bool topLevel;
+    // The position of the loop this function was created for, if any
+    uint64_t loop;
+};
+
+struct Compiler {
+    std::vector<uint8_t>& opcodes;
+    std::vector<llvm::orc::ThreadSafeModule> modules;
+    std::vector<std::string> names;
+};
+
+static std::string compileFunction(Compiler& compiler, std::string name, uint64_t begin, uint64_t end, bool topLevel, uint64_t loop);
+
+// All functions take the data pointer and return where it ended up.
+static llvm::FunctionType* getFunctionType(llvm::LLVMContext& context)
 {
-    // Read input file
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " INPUT" << std::endl;
-        exit(1);
-    }
+    auto* pointerType = llvm::Type::getInt8PtrTy(context);
+    return llvm::FunctionType::get(pointerType, { pointerType }, false);
+}
 
-    std::ifstream in(argv[argc - 1]);
-    std::string source(static_cast<std::stringstream const&>(std::stringstream() << in.rdbuf()).str());
+static llvm::Value* getCell(FunctionBuilder& f, int8_t offset)
+{
+    auto& builder = *f.builder;
+    llvm::Value* pointer = builder.CreateLoad(builder.getInt8PtrTy(), f.dataPointer);
+    if (offset == 0)
+        return pointer;
+    return builder.CreateGEP(builder.getInt8Ty(), pointer, builder.getInt64(offset));
+}
 
-    // Compile the code to bytecode
-    auto opcodes = compileByteCode(source);
-    if (argc > 2) {
-        printByteCode(opcodes);
-        std::cout << opcodes.size() << std::endl;
-        exit(0);
-    }
+static void emitCall(FunctionBuilder& f, std::string name)
+{
+    auto& builder = *f.builder;
+    auto callee = f.module->getOrInsertFunction(name, getFunctionType(*f.context));
+    llvm::Value* pointer = builder.CreateLoad(builder.getInt8PtrTy(), f.dataPointer);
+    builder.CreateStore(builder.CreateCall(callee, { pointer }), f.dataPointer);
+}
+
+static void emitRange(Compiler& compiler, FunctionBuilder& f, uint64_t begin, uint64_t end);
+
+/**
+ * @brief Emits a loop whose body is in [begin, end). Counted loops keep their
+ * trip count in a local variable and don't have to load the cell to test it.
+ *
+ * @param compiler
+ * @param f
+ * @param counted
+ * @param begin
+ * @param end
+ */
+static void emitLoop(Compiler& compiler, FunctionBuilder& f, bool counted, uint64_t begin, uint64_t end)
+{
+    auto& builder = *f.builder;
+    auto* head = llvm::BasicBlock::Create(*f.context, "loop", f.function);
+    auto* body = llvm::BasicBlock::Create(*f.context, "body", f.function);
+    auto* exit = llvm::BasicBlock::Create(*f.context, "exit", f.function);
 
-    // Compile to llvm IR
-    auto TheContext = std::make_unique<llvm::LLVMContext>();
-    auto TheModule = std::make_unique<llvm::Module>("brainllvm jit", *TheContext);
-    auto Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+    if (!counted) {
+        builder.CreateBr(head);
+        builder.SetInsertPoint(head);
+        llvm::Value* value = builder.CreateLoad(builder.getInt8Ty(), getCell(f, 0));
+        builder.CreateCondBr(builder.CreateICmpNE(value, builder.getInt8(0)), body, exit);
 
-    // Build a basic function entry into which the whole brainfuck code gets
-    // compiled
-    llvm::FunctionType* FT = llvm::FunctionType::get(llvm::Type::getVoidTy(*TheContext), false);
-    std::string Name = "bf_main";
-    llvm::Function* TheFunction = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
+        builder.SetInsertPoint(body);
+        emitRange(compiler, f, begin, end);
+        builder.CreateBr(head);
+        builder.SetInsertPoint(exit);
+        return;
+    }
 
-    llvm::BasicBlock* BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
+    // Allocas outside of the entry block don't get promoted to registers.
+    auto& entry = f.function->getEntryBlock();
+    llvm::IRBuilder<> entryBuilder(&entry, entry.begin());
+    llvm::Value* counter = entryBuilder.CreateAlloca(builder.getInt8Ty());
 
-    // Create the tape
-    // Builder->CreateAlloca(llvm::ArrayType::getInt8Ty(*TheContext));
-    Builder->CreateAlloca(llvm::ArrayType::get(llvm::ArrayType::getInt8Ty(*TheContext), 30000));
+    llvm::Value* value = builder.CreateLoad(builder.getInt8Ty(), getCell(f, 0));
+    builder.CreateStore(value, counter);
+    builder.CreateCondBr(builder.CreateICmpNE(value, builder.getInt8(0)), head, exit);
 
-    // auto v = llvm::ConstantInt(llvm::IntegerType::getInt64Ty(*TheContext), llvm::APInt((uint64_t)0));
+    builder.SetInsertPoint(head);
+    builder.CreateBr(body);
+    builder.SetInsertPoint(body);
+    emitRange(compiler, f, begin, end);
+    llvm::Value* count = builder.CreateSub(builder.CreateLoad(builder.getInt8Ty(), counter), builder.getInt8(1));
+    builder.CreateStore(count, counter);
+    builder.CreateCondBr(builder.CreateICmpNE(count, builder.getInt8(0)), head, exit);
+    builder.SetInsertPoint(exit);
+}
 
-    Builder->CreateRet(nullptr);
-    llvm::verifyFunction(*TheFunction);
-    TheFunction->print(llvm::errs());
-    return 1;
+/**
+ * @brief Emits the bytecode in [begin, end) into the function. Large loops
+ * and everything after the function grew too large are compiled to their own
+ * functions which are only called from here.
+ *
+ * @param compiler
+ * @param f
+ * @param begin
+ * @param end
+ */
+static void emitRange(Compiler& compiler, FunctionBuilder& f, uint64_t begin, uint64_t end)
+{
+    auto& builder = *f.builder;
+    auto& opcodes = compiler.opcodes;
+
+    for (uint64_t i = begin; i < end; i++) {
+        uint64_t position = i;
+        if (f.size >= OUTLINE_SIZE) {
+            emitCall(f, compileFunction(compiler, "bf_chunk_" + std::to_string(position), position, end, f.topLevel, UINT64_MAX));
+            return;
+        }
 
-    for (uint64_t i = 0; i < opcodes.size(); i++) {
-        // std::cout << instructionPointer << " -> " << dataPointer << std::endl;
         switch (opcodes.at(i)) {
         case OP_MOVE: {
             int8_t argument = readByteArgument(opcodes, i);
-            // Builder->CreateAdd();
+            builder.CreateStore(getCell(f, argument), f.dataPointer);
             break;
         }
 
         case OP_INC: {
             int8_t offset = readByteArgument(opcodes, i);
             int8_t increment = readByteArgument(opcodes, i);
+            llvm::Value* cell = getCell(f, offset);
+            llvm::Value* value = builder.CreateLoad(builder.getInt8Ty(), cell);
+            builder.CreateStore(builder.CreateAdd(value, builder.getInt8(increment)), cell);
             break;
         }
 
-        case OP_OPEN: {
+        case OP_OPEN:
+        case OP_COUNT_OPEN: {
+            bool counted = opcodes.at(i) == OP_COUNT_OPEN;
             uint64_t argument = readEightByteArgument(opcodes, i);
-            break;
-        }
+            uint64_t loopEnd = argument + 1;
 
-        case OP_CLOSE: {
-            uint64_t argument = readEightByteArgument(opcodes, i);
+            // The argument points to the last byte of the closing instruction.
+            if (position != f.loop && (f.topLevel || loopEnd - position > OUTLINE_SIZE)) {
+                emitCall(f, compileFunction(compiler, "bf_loop_" + std::to_string(position), position, loopEnd, false, position));
+            } else {
+                emitLoop(compiler, f, counted, i + 1, argument - 8);
+            }
+            i = argument;
             break;
         }
 
         case OP_CLEAR: {
+            builder.CreateStore(builder.getInt8(0), getCell(f, 0));
             break;
         }
 
         case OP_MUL: {
             int8_t offset = readByteArgument(opcodes, i);
             int8_t factor = readByteArgument(opcodes, i);
+            llvm::Value* value = builder.CreateLoad(builder.getInt8Ty(), getCell(f, 0));
+            llvm::Value* cell = getCell(f, offset);
+            llvm::Value* product = builder.CreateMul(value, builder.getInt8(factor));
+            builder.CreateStore(builder.CreateAdd(builder.CreateLoad(builder.getInt8Ty(), cell), product), cell);
             break;
         }
 
-        case OP_WRITE:
+        case OP_WRITE: {
+            auto putchar = f.module->getOrInsertFunction("putchar", builder.getInt32Ty(), builder.getInt32Ty());
+            llvm::Value* value = builder.CreateLoad(builder.getInt8Ty(), getCell(f, 0));
+            builder.CreateCall(putchar, { builder.CreateZExt(value, builder.getInt32Ty()) });
             break;
+        }
 
-        case OP_READ:
+        case OP_READ: {
+            auto getchar = f.module->getOrInsertFunction("getchar", builder.getInt32Ty());
+            llvm::Value* value = builder.CreateCall(getchar);
+            builder.CreateStore(builder.CreateTrunc(value, builder.getInt8Ty()), getCell(f, 0));
             break;
+        }
 
         default:
             std::cerr << "ERROR: Unknown opcode!" << std::endl;
             exit(1);
         }
+
+        f.size += i + 1 - position;
+    }
+}
+
+/**
+ * @brief Compiles the bytecode in [begin, end) to a new function in a new
+ * module.
+ *
+ * @param compiler
+ * @param name
+ * @param begin
+ * @param end
+ * @param topLevel if the code is not inside of any loop.
+ * @param loop the position of the loop the function is for, the loop gets
+ * emitted into the function instead of being outlined again.
+ * @return the name of the function.
+ */
+static std::string compileFunction(Compiler& compiler, std::string name, uint64_t begin, uint64_t end, bool topLevel, uint64_t loop)
+{
+    // Callers come first, so that the functions get compiled in about the
+    // order they are needed.
+    compiler.names.push_back(name);
+
+    FunctionBuilder f;
+    f.context = std::make_unique<llvm::LLVMContext>();
+    f.module = std::make_unique<llvm::Module>(name, *f.context);
+    f.builder = std::make_unique<llvm::IRBuilder<>>(*f.context);
+    f.topLevel = topLevel;
+    f.loop = loop;
+
+    auto& builder = *f.builder;
+    f.function = llvm::Function::Create(getFunctionType(*f.context), llvm::Function::ExternalLinkage, name, f.module.get());
+    builder.SetInsertPoint(llvm::BasicBlock::Create(*f.context, "entry", f.function));
+    f.dataPointer = builder.CreateAlloca(builder.getInt8PtrTy());
+    builder.CreateStore(f.function->getArg(0), f.dataPointer);
+
+    emitRange(compiler, f, begin, end);
+    builder.CreateRet(builder.CreateLoad(builder.getInt8PtrTy(), f.dataPointer));
+
+    if (llvm::verifyFunction(*f.function, &llvm::errs())) {
+        std::cerr << "ERROR: Generated invalid function " << name << std::endl;
+        exit(1);
+    }
+
+    compiler.modules.emplace_back(std::move(f.module), std::move(f.context));
+    return name;
+}
+
+/**
+ * @brief Optimizes a module before it gets compiled. This runs on the compile
+ * threads, which is fine since every module has its own context.
+ *
+ * @param module
+ * @return the optimized module.
+ */
+static llvm::Expected<llvm::orc::ThreadSafeModule> optimizeModule(llvm::orc::ThreadSafeModule module, const llvm::orc::MaterializationResponsibility&)
+{
+    module.withModuleDo([](llvm::Module& m) {
+        llvm::LoopAnalysisManager loopAnalysis;
+        llvm::FunctionAnalysisManager functionAnalysis;
+        llvm::CGSCCAnalysisManager cgsccAnalysis;
+        llvm::ModuleAnalysisManager moduleAnalysis;
+
+        llvm::PassBuilder passBuilder;
+        passBuilder.registerModuleAnalyses(moduleAnalysis);
+        passBuilder.registerCGSCCAnalyses(cgsccAnalysis);
+        passBuilder.registerFunctionAnalyses(functionAnalysis);
+        passBuilder.registerLoopAnalyses(loopAnalysis);
+        passBuilder.crossRegisterProxies(loopAnalysis, functionAnalysis, cgsccAnalysis, moduleAnalysis);
+
+        auto passes = passBuilder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+        passes.run(m, moduleAnalysis);
+    });
+    return module;
+}
+
+// Compiles the functions in the background, but only as many at a time as
+// there are compile threads. The thread pool runs its tasks in order, so a
+// function the program calls would otherwise wait until everything before it
+// in the queue was compiled.
+struct BackgroundCompiler {
+    llvm::orc::ExecutionSession& session;
+    llvm::orc::JITDylib& implementation;
+    std::vector<llvm::orc::SymbolStringPtr> symbols;
+    std::atomic<size_t> next = 0;
+
+    void compileNext()
+    {
+        size_t i = next++;
+        if (i >= symbols.size())
+            return;
+
+        session.lookup(
+            llvm::orc::LookupKind::Static, llvm::orc::makeJITDylibSearchOrder(&implementation),
+            llvm::orc::SymbolLookupSet(symbols.at(i)), llvm::orc::SymbolState::Ready,
+            [this](llvm::Expected<llvm::orc::SymbolMap> result) {
+                if (!result)
+                    session.reportError(result.takeError());
+                compileNext();
+            },
+            llvm::orc::NoDependenciesToRegister);
+    }
+};
+
+/**
+ * @brief Starts compiling all functions on the compile threads without
+ * waiting for them. Calling a function that is still being compiled waits for
+ * it, so the program can start right away while the rest is compiled in the
+ * background.
+ *
+ * @param jit
+ * @param names
+ * @param threads
+ */
+static void compileInBackground(llvm::orc::LLLazyJIT& jit, std::vector<std::string>& names, unsigned threads)
+{
+    auto& session = jit.getExecutionSession();
+    llvm::orc::SymbolLookupSet symbols;
+    for (auto& name : names)
+        symbols.add(jit.mangleAndIntern(name));
+
+    // Looking up the functions in the main JITDylib only creates their stubs
+    // and hands the modules to the implementation JITDylib of the compile on
+    // demand layer, looking them up there compiles them. LLVM has no API to
+    // get that JITDylib, so we rely on the name the layer gives it.
+    exitOnError(session.lookup(llvm::orc::makeJITDylibSearchOrder(&jit.getMainJITDylib()), symbols).takeError());
+    auto* implementation = session.getJITDylibByName(jit.getMainJITDylib().getName() + ".impl");
+    if (implementation == nullptr) {
+        std::cerr << "WARNING: Couldn't find the functions to compile in the background, they are compiled on their first call" << std::endl;
+        return;
     }
 
-    // Setup the datastructure
-    uint8_t array[30000];
-    std::memset(array, 0, 30000);
+    // Never freed, as the compile threads might use it until we exit.
+    auto* compiler = new BackgroundCompiler { session, *implementation, {} };
+    for (auto& symbol : symbols)
+        compiler->symbols.push_back(symbol.first);
+    for (unsigned i = 0; i < threads; i++)
+        compiler->compileNext();
+}
+
+// Counted loops in traces keep their trip counts on the counters of the
+// machine, so the interpreter can continue them after an exit.
+static void countPush(std::vector<uint8_t>* counters, uint8_t count)
+{
+    counters->push_back(count);
+}
+
+// Returns 0 if the counted loop is done, the trace exits then.
+static uint8_t countLoop(std::vector<uint8_t>* counters)
+{
+    if (counters->back() == 1)
+        return 0;
+    counters->back()--;
+    return 1;
+}
+
+// Returns 0 if the counted loop isn't done, the trace exits then.
+static uint8_t countDone(std::vector<uint8_t>* counters)
+{
+    if (counters->back() != 1)
+        return 0;
+    counters->pop_back();
+    return 1;
+}
+
+/**
+ * @brief Compiles an optimized trace to a native function, see NativeTrace.
+ * The ops become straight-line code, guards branch to exit blocks which write
+ * the stores that are still pending and return where the interpreter
+ * continues.
+ *
+ * @param jit
+ * @param trace
+ * @return the native code of the trace.
+ */
+static NativeTrace compileTrace(llvm::orc::LLJIT& jit, Trace& trace)
+{
+    // Every loop head has at most one trace.
+    std::string name = "bf_trace_" + std::to_string(trace.head);
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = std::make_unique<llvm::Module>(name, *context);
+    llvm::IRBuilder<> builder(*context);
+
+    auto* pointerType = builder.getInt8PtrTy();
+    auto* type = llvm::FunctionType::get(builder.getInt64Ty(), { pointerType->getPointerTo(), pointerType }, false);
+    auto* function = llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, module.get());
+    llvm::Value* counters = function->getArg(1);
+
+    // Stack slot of the data pointer, mem2reg turns it into a register
+    builder.SetInsertPoint(llvm::BasicBlock::Create(*context, "entry", function));
+    llvm::Value* dataPointer = builder.CreateAlloca(pointerType);
+    builder.CreateStore(builder.CreateLoad(pointerType, function->getArg(0)), dataPointer);
+    auto* start = llvm::BasicBlock::Create(*context, "start", function);
+    builder.CreateBr(start);
+    builder.SetInsertPoint(start);
+
+    auto getCell = [&](int32_t offset) {
+        llvm::Value* pointer = builder.CreateLoad(pointerType, dataPointer);
+        return builder.CreateGEP(builder.getInt8Ty(), pointer, builder.getInt64(offset));
+    };
+    auto loadCell = [&](int32_t offset, uint8_t addend) {
+        llvm::Value* value = builder.CreateLoad(builder.getInt8Ty(), getCell(offset));
+        return builder.CreateAdd(value, builder.getInt8(addend));
+    };
+    auto move = [&](int32_t offset) {
+        builder.CreateStore(getCell(offset), dataPointer);
+    };
+
+    // The counter helpers are called by their address in this process.
+    auto callHelper = [&](uint64_t address, llvm::Type* result, std::vector<llvm::Value*> arguments) {
+        std::vector<llvm::Type*> types;
+        for (auto* argument : arguments)
+            types.push_back(argument->getType());
+        auto* helperType = llvm::FunctionType::get(result, types, false);
+        auto* callee = builder.CreateIntToPtr(builder.getInt64(address), helperType->getPointerTo());
+        return builder.CreateCall(helperType, callee, arguments);
+    };
+
+    std::vector<llvm::BasicBlock*> exits(trace.exits.size(), nullptr);
+    auto getExit = [&](uint32_t index) {
+        if (exits.at(index) != nullptr)
+            return exits.at(index);
+
+        auto* current = builder.GetInsertBlock();
+        exits.at(index) = llvm::BasicBlock::Create(*context, "exit", function);
+        builder.SetInsertPoint(exits.at(index));
+        TraceExit& exit = trace.exits.at(index);
+        for (auto& write : exit.writes) {
+            llvm::Value* cell = getCell(write.offset);
+            llvm::Value* value = builder.getInt8(write.value);
+            if (!write.set)
+                value = builder.CreateAdd(builder.CreateLoad(builder.getInt8Ty(), cell), value);
+            builder.CreateStore(value, cell);
+        }
+        builder.CreateStore(getCell(exit.offset), function->getArg(0));
+        builder.CreateRet(builder.getInt64(exit.instructionPointer));
+        builder.SetInsertPoint(current);
+        return exits.at(index);
+    };
+    auto guard = [&](llvm::Value* condition, uint32_t exit) {
+        auto* next = llvm::BasicBlock::Create(*context, "next", function);
+        builder.CreateCondBr(condition, next, getExit(exit));
+        builder.SetInsertPoint(next);
+    };
+
+    // Traces end with a loop or an exit.
+    for (auto& op : trace.ops) {
+        switch (op.kind) {
+        case TRACE_ADD:
+        case TRACE_SET: {
+            llvm::Value* cell = getCell(op.offset);
+            llvm::Value* value = builder.getInt8(op.value);
+            if (op.kind == TRACE_ADD)
+                value = builder.CreateAdd(builder.CreateLoad(builder.getInt8Ty(), cell), value);
+            builder.CreateStore(value, cell);
+            break;
+        }
+
+        case TRACE_MUL: {
+            llvm::Value* product = builder.CreateMul(loadCell(op.source, op.addend), builder.getInt8(op.value));
+            llvm::Value* cell = getCell(op.offset);
+            builder.CreateStore(builder.CreateAdd(builder.CreateLoad(builder.getInt8Ty(), cell), product), cell);
+            break;
+        }
+
+        case TRACE_WRITE: {
+            auto putchar = module->getOrInsertFunction("putchar", builder.getInt32Ty(), builder.getInt32Ty());
+            builder.CreateCall(putchar, { builder.CreateZExt(loadCell(op.offset, op.addend), builder.getInt32Ty()) });
+            break;
+        }
+
+        case TRACE_READ: {
+            // getchar always has input, so reads never exit.
+            auto getchar = module->getOrInsertFunction("getchar", builder.getInt32Ty());
+            builder.CreateStore(builder.CreateTrunc(builder.CreateCall(getchar), builder.getInt8Ty()), getCell(op.offset));
+            break;
+        }
+
+        case TRACE_GUARD_ZERO:
+            guard(builder.CreateICmpEQ(loadCell(op.offset, op.addend), builder.getInt8(0)), op.exit);
+            break;
+
+        case TRACE_GUARD_NONZERO:
+            guard(builder.CreateICmpNE(loadCell(op.offset, op.addend), builder.getInt8(0)), op.exit);
+            break;
+
+        case TRACE_COUNT_PUSH:
+            callHelper((uint64_t)&countPush, builder.getVoidTy(), { counters, loadCell(op.offset, op.addend) });
+            break;
+
+        case TRACE_COUNT_LOOP:
+        case TRACE_COUNT_DONE: {
+            uint64_t helper = op.kind == TRACE_COUNT_LOOP ? (uint64_t)&countLoop : (uint64_t)&countDone;
+            llvm::Value* result = callHelper(helper, builder.getInt8Ty(), { counters });
+            guard(builder.CreateICmpNE(result, builder.getInt8(0)), op.exit);
+            break;
+        }
+
+        case TRACE_SCAN: {
+            auto* head = llvm::BasicBlock::Create(*context, "scan", function);
+            auto* body = llvm::BasicBlock::Create(*context, "body", function);
+            auto* end = llvm::BasicBlock::Create(*context, "end", function);
+            move(op.offset);
+            builder.CreateBr(head);
+            builder.SetInsertPoint(head);
+            builder.CreateCondBr(builder.CreateICmpNE(loadCell(0, 0), builder.getInt8(0)), body, end);
+            builder.SetInsertPoint(body);
+            move((int8_t)op.value);
+            builder.CreateBr(head);
+            builder.SetInsertPoint(end);
+            break;
+        }
+
+        case TRACE_LOOP:
+            move(op.offset);
+            builder.CreateBr(start);
+            break;
+
+        case TRACE_EXIT:
+            builder.CreateBr(getExit(op.exit));
+            break;
+        }
+    }
+
+    if (llvm::verifyFunction(*function, &llvm::errs())) {
+        std::cerr << "ERROR: Generated invalid function " << name << std::endl;
+        exit(1);
+    }
+
+    exitOnError(jit.addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+    auto symbol = exitOnError(jit.lookup(name));
+    return (NativeTrace)symbol.getAddress();
+}
+
+// The interpreter does the same I/O as the compiled code and traces.
+struct StandardIO {
+    bool read(uint8_t& c)
+    {
+        c = std::getchar();
+        return true;
+    }
+
+    void write(uint8_t c)
+    {
+        std::putchar(c);
+    }
+};
+
+/**
+ * @brief Interprets the bytecode and records the paths hot loops take, like
+ * brainbyte --trace, but every trace is compiled to native code. The traces
+ * are small, so they are compiled right away on this thread.
+ *
+ * @param opcodes
+ */
+static void runTraced(std::vector<uint8_t>& opcodes)
+{
+    auto jit = exitOnError(llvm::orc::LLJITBuilder().create());
+    jit->getIRTransformLayer().setTransform(optimizeModule);
+    char prefix = jit->getDataLayout().getGlobalPrefix();
+    jit->getMainJITDylib().addGenerator(exitOnError(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix)));
+
+    Tracer tracer(opcodes);
+    tracer.compile = [&](Trace& trace) { return compileTrace(*jit, trace); };
+
+    Machine machine;
+    StandardIO io;
+    interpret<false, false, true>(machine, opcodes, io, nullptr, &tracer);
+}
+
+int main(int argc, char const* argv[])
+{
+    // Read input file
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--lazy] [--threads N] [--trace] INPUT" << std::endl;
+        exit(1);
+    }
+
+    // Parse the options, any unknown argument just dumps the bytecode.
+    bool dump = false;
+    bool lazy = false;
+    bool trace = false;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc - 1; i++) {
+        if (std::strcmp(argv[i], "--lazy") == 0) {
+            lazy = true;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc - 1) {
+            threads = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--trace") == 0) {
+            trace = true;
+        } else {
+            dump = true;
+        }
+    }
+
+    std::ifstream in(argv[argc - 1]);
+    std::string source(static_cast<std::stringstream const&>(std::stringstream() << in.rdbuf()).str());
+
+    // Compile the code to bytecode
+    auto opcodes = compileByteCode(source);
+    if (dump) {
+        printByteCode(opcodes);
+        std::cout << opcodes.size() << std::endl;
+        exit(0);
+    }
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    if (trace) {
+        runTraced(opcodes);
+        std::fflush(stdout);
+        return 0;
+    }
+
+    // Compile to llvm IR, the top level code starts in bf_main
+    Compiler compiler { opcodes, {}, {} };
+    compileFunction(compiler, "bf_main", 0, opcodes.size(), true, UINT64_MAX);
+
+    // Only compiling goes to the compile threads. Everything else, like
+    // telling the program that a function is ready, is quick and would
+    // otherwise have to wait behind the compiles in the queue. We set up the
+    // session ourselves instead of using setNumCompileThreads, which would
+    // create a second pool for its own dispatcher.
+    llvm::ThreadPool pool(llvm::hardware_concurrency(threads));
+    auto session = std::make_unique<llvm::orc::ExecutionSession>(exitOnError(llvm::orc::SelfExecutorProcessControl::Create()));
+    session->setDispatchTask([&pool](std::unique_ptr<llvm::orc::Task> task) {
+        if (!llvm::isa<llvm::orc::MaterializationTask>(task.get())) {
+            task->run();
+            return;
+        }
+
+        pool.async([task = task.release()]() {
+            task->run();
+            delete task;
+        });
+    });
+
+    // Every module is compiled as a whole once one of its functions gets
+    // called for the first time. The compiler has to be thread safe, as
+    // setNumCompileThreads would otherwise choose that one for us.
+    auto jit = exitOnError(llvm::orc::LLLazyJITBuilder()
+                               .setExecutionSession(std::move(session))
+                               .setCompileFunctionCreator([](llvm::orc::JITTargetMachineBuilder machine) -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                                   return std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(machine));
+                               })
+                               .create());
+    jit->setPartitionFunction(llvm::orc::CompileOnDemandLayer::compileWholeModule);
+    jit->getIRTransformLayer().setTransform(optimizeModule);
+
+    // putchar and getchar come from the C library of our own process.
+    char prefix = jit->getDataLayout().getGlobalPrefix();
+    jit->getMainJITDylib().addGenerator(exitOnError(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix)));
+
+    for (auto& module : compiler.modules)
+        exitOnError(jit->addLazyIRModule(std::move(module)));
+
+    if (!lazy)
+        compileInBackground(*jit, compiler.names, threads);
 
     // Run the compiled function.
+    auto symbol = exitOnError(jit->lookup("bf_main"));
+    auto bfMain = (uint8_t * (*)(uint8_t*)) symbol.getAddress();
+    std::vector<uint8_t> tape(TAPE_SIZE, 0);
+    bfMain(tape.data());
+
+    // The compile threads might still be busy with functions that never got
+    // called, we don't wait for them.
+    std::fflush(stdout);
+    std::_Exit(0);
 }
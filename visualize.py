@@ -5,18 +5,42 @@ import subprocess
 import pandas as pd
 import concurrent.futures
 import os
-
-PROGRAMS = ["brainint", "brainbyte", "braindyn"]
+import sys
+
+# The metered variants get so much fuel that they never run out, so they show
+# the overhead of metering.
+PROGRAMS = {
+    "brainint": ["brainint"],
+    "brainbyte": ["brainbyte"],
+    "brainbyte (fuel)": ["brainbyte", "--fuel", str(2**62)],
+    "braindyn": ["braindyn"],
+    "braindyn (fuel)": ["braindyn", "--fuel", str(2**62)],
+    "brainllvm": ["brainllvm"],
+    "brainconst": ["brainconst"],
+}
 BENCHMARKS = ["helloworld.bf", "99bottles.bf", "mandelbrot.bf", "hanoi.bf"]
 
+# brainconst only contains some of the benchmarks, the others get no bar.
+EMBEDDED = {"brainconst": ["helloworld.bf", "99bottles.bf", "mandelbrot.bf"]}
+
 
 def run(target):
-    executable = "build/" + target[0]
+    command = PROGRAMS[target[0]]
+    executable = "build/" + command[0]
     program = "examples/" + target[1]
+    if target[1] not in EMBEDDED.get(command[0], BENCHMARKS):
+        return float("nan")
 
     start = time.time_ns()
-    subprocess.run([executable, program], capture_output=True)
+    result = subprocess.run([executable] + command[1:] + [program], capture_output=True)
     elapsed_ms = (time.time_ns() - start) / 1000 / 1000
+
+    # A failed run would show up as a fast one.
+    if result.returncode != 0:
+        raise RuntimeError(
+            f"{target[0]} failed on {target[1]} with exit code {result.returncode}:\n"
+            + result.stderr.decode(errors="replace")
+        )
     return elapsed_ms
 
 
@@ -41,7 +65,7 @@ def plot(results):
         data.append(out)
     df = pd.DataFrame(
         data,
-        columns=["Programs"] + PROGRAMS,
+        columns=["Programs"] + list(PROGRAMS),
     )
 
     # Create the plot
@@ -61,7 +85,55 @@ def plot(results):
     fig.savefig("plot.png")
 
 
+# Plots the CSV files of `brainbyte --profile PREFIX` to PREFIX.png
+def plot_profile(prefix):
+    import matplotlib.pyplot as plt
+    import numpy as np
+
+    cells = pd.read_csv(f"{prefix}-cells.csv")
+    moves = pd.read_csv(f"{prefix}-moves.csv")
+    working_set = pd.read_csv(f"{prefix}-working-set.csv")
+
+    fig, (heatmap_ax, moves_ax, working_set_ax) = plt.subplots(3, 1, figsize=(10, 14))
+
+    # One row per cache line, so the hot lines stand out.
+    line_size = 64
+    first = cells["cell"].min() // line_size * line_size
+    rows = (cells["cell"].max() - first) // line_size + 1
+    heatmap = np.zeros(rows * line_size)
+    heatmap[cells["cell"] - first] = cells["reads"] + cells["writes"]
+    image = heatmap_ax.imshow(
+        np.log10(heatmap.reshape(rows, line_size) + 1),
+        aspect="auto",
+        interpolation="nearest",
+        extent=(0, line_size, first + rows * line_size, first),
+    )
+    fig.colorbar(image, ax=heatmap_ax, label="log10(accesses + 1)")
+    heatmap_ax.set_title("Tape accesses")
+    heatmap_ax.set_xlabel("Offset in cache line")
+    heatmap_ax.set_ylabel("Cell")
+
+    moves_ax.bar(moves["distance"], moves["count"])
+    moves_ax.set_yscale("log")
+    moves_ax.set_title("Data pointer moves")
+    moves_ax.set_xlabel("Distance")
+    moves_ax.set_ylabel("Count")
+
+    working_set_ax.plot(working_set["instructions"], working_set["cells"])
+    working_set_ax.set_title("Working set")
+    working_set_ax.set_xlabel("Instructions")
+    working_set_ax.set_ylabel("Cells")
+
+    fig.tight_layout()
+    fig.savefig(f"{prefix}.png")
+
+
 def main():
+    # Plot a tape profile instead of running the benchmarks
+    if len(sys.argv) == 3 and sys.argv[1] == "--profile":
+        plot_profile(sys.argv[2])
+        return
+
     # Create all targets
     targets = [(p, b) for b in BENCHMARKS for p in PROGRAMS]
 